@@ -0,0 +1,749 @@
+/*
+ * microbenchmarks for the image kernels and the glyph mapping, each one runs
+ * on generated frames of a few common camera sizes and gets its cycles per
+ * pixel and memory throughput, the results can be kept as a baseline that
+ * later runs are checked against
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <getopt.h>
+#include <turbojpeg.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_CYCLES 1
+#else
+#define HAVE_CYCLES 0
+#endif
+
+#include "../src/include/img.h"
+#include "../src/include/disp.h"
+#include "../src/include/luma.h"
+#include "../src/include/pool.h"
+
+#define MAX_SIZES       8
+#define MAX_CASES       32
+#define MAX_BASELINE    256
+
+/* every kernel is timed this many times and the median is kept, a single
+   sample runs the kernel often enough to last at least SAMPLE_NS */
+#define SAMPLES         15
+#define SAMPLE_NS       2000000
+
+/* the grid the resize kernels scale down to, a large terminal */
+#define GRID_WIDTH      240
+#define GRID_HEIGHT     67
+
+#define JPEG_QUALITY    85
+
+/* generated input for one frame size, and room for every kernel's output */
+struct buffers {
+    int             width;
+    int             height;
+    image_t         rgb;
+    image_t         grey;
+    image_t         yuyv;
+    image_t         out;        /* full size grey */
+    image_t         grid;       /* GRID_WIDTH x GRID_HEIGHT grey */
+    image_t         colour;     /* the same in half blocks, RGB */
+    char            *glyphs;
+    uint8_t         *jpeg;
+    unsigned long   jpeg_size;
+    jpeg_decoder_t  decoder;
+};
+
+struct bench_case {
+    char        name[32];
+    void        (*run)(struct buffers *b, luma_row_t row);
+    size_t      (*bytes)(struct buffers *b);  /* read + written per call */
+    luma_row_t  row;
+};
+
+struct measurement {
+    char    name[32];
+    int     width;
+    int     height;
+    double  ns_per_pixel;
+    double  cycles_per_pixel;
+    double  gb_per_s;
+};
+
+struct baseline_entry {
+    char    name[32];
+    int     width;
+    int     height;
+    double  ns_per_pixel;
+};
+
+static struct {
+    int width;
+    int height;
+} sizes[MAX_SIZES] = {
+    { 640, 480 }, { 1280, 720 }, { 1920, 1080 }
+};
+static int              n_sizes = 3;
+
+static struct bench_case cases[MAX_CASES];
+static int              n_cases;
+
+static struct measurement *measurements;
+static int              n_measurements;
+
+static struct baseline_entry baseline[MAX_BASELINE];
+static int              n_baseline;
+
+static const char       *filter;
+static const char       *baseline_name;
+static const char       *write_name;
+static const char       *json_name;
+static double           threshold = 10.0;   /* percent */
+
+/* the human readable report, moves to stderr when the JSON takes stdout */
+static FILE             *report;
+
+static uint64_t now_ns(void){
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static uint64_t read_cycles(void){
+#if HAVE_CYCLES
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static size_t pixels(struct buffers *b){
+    return (size_t)b->width * b->height;
+}
+
+static size_t grid_pixels(void){
+    return (size_t)GRID_WIDTH * GRID_HEIGHT;
+}
+
+/* the kernels */
+
+static void run_luma_row(struct buffers *b, luma_row_t row){
+    for (int y = 0; y < b->height; y++) {
+        row(PIXEL_AT(&b->rgb, 0, y), PIXEL_AT(&b->out, 0, y), b->width);
+    }
+}
+
+static size_t bytes_luma(struct buffers *b){
+    return pixels(b) * 4;
+}
+
+static void run_rgb_to_grey(struct buffers *b, luma_row_t row){
+    rgb_to_grey(&b->rgb, &b->out);
+}
+
+static void run_resize_grey(struct buffers *b, luma_row_t row){
+    resize_image(&b->grey, &b->grid);
+}
+
+static void run_resize_yuyv(struct buffers *b, luma_row_t row){
+    resize_image(&b->yuyv, &b->grid);
+}
+
+/* one byte sampled and one written per grid cell */
+static size_t bytes_resize(struct buffers *b){
+    return grid_pixels() * 2;
+}
+
+static void run_resize_rgb_to_grey(struct buffers *b, luma_row_t row){
+    resize_rgb_to_grey(&b->rgb, &b->grid);
+}
+
+static size_t bytes_resize_rgb(struct buffers *b){
+    return grid_pixels() * 4;
+}
+
+static void run_resize_to_rgb(struct buffers *b, luma_row_t row){
+    resize_to_rgb(&b->rgb, LAYOUT_RGB, &b->colour);
+}
+
+static void run_resize_yuyv_to_rgb(struct buffers *b, luma_row_t row){
+    resize_to_rgb(&b->yuyv, LAYOUT_YUYV, &b->colour);
+}
+
+/* two grid rows a cell, RGB sampled and written */
+static size_t bytes_resize_to_rgb(struct buffers *b){
+    return grid_pixels() * 2 * 6;
+}
+
+static void run_decompress_jpeg(struct buffers *b, luma_row_t row){
+
+    image_t decoded;
+
+    if (decompress_jpeg(&b->decoder, b->jpeg, b->jpeg_size, &decoded)) {
+        exit(EXIT_FAILURE);
+    }
+}
+
+static size_t bytes_jpeg(struct buffers *b){
+    return b->jpeg_size + pixels(b);
+}
+
+static void run_map_glyphs(struct buffers *b, luma_row_t row){
+    map_glyphs(b->grey.image, b->glyphs, b->height, b->width, b->width);
+}
+
+static size_t bytes_glyphs(struct buffers *b){
+    return pixels(b) * 2;
+}
+
+/* the same pixels as map_glyphs, eight to a cell */
+static void run_map_braille(struct buffers *b, luma_row_t row){
+    map_braille(b->grey.image, b->glyphs, b->height / 4, b->width / 2,
+                b->width);
+}
+
+static size_t bytes_braille(struct buffers *b){
+    return pixels(b) + pixels(b) / 8 * 3;
+}
+
+static uint8_t identity[256];
+
+/* on a copy of the grey frame, a dithered one would only get dithered
+   again */
+static void run_dither_ordered(struct buffers *b, luma_row_t row){
+    memcpy(b->out.image, b->grey.image, pixels(b));
+    dither_image(&b->out, 10, identity, DITHER_ORDERED);
+}
+
+static void run_dither_diffusion(struct buffers *b, luma_row_t row){
+    memcpy(b->out.image, b->grey.image, pixels(b));
+    dither_image(&b->out, 10, identity, DITHER_DIFFUSION);
+}
+
+static void add_case(
+    const char *name,
+    void (*run)(struct buffers*, luma_row_t),
+    size_t (*bytes)(struct buffers*),
+    luma_row_t row
+){
+
+    struct bench_case *c;
+
+    if (filter && !strstr(name, filter)) {
+        return;
+    }
+
+    c = &cases[n_cases++];
+    snprintf(c->name, sizeof(c->name), "%s", name);
+    c->run = run;
+    c->bytes = bytes;
+    c->row = row;
+}
+
+static void init_cases(void){
+
+    char name[32];
+
+    for (int i = 0; i < 256; i++) {
+        identity[i] = i;
+    }
+
+    for (int i = 0; i < n_luma_kernels; i++) {
+        if (!luma_kernels[i].supported()) {
+            continue;
+        }
+        snprintf(name, sizeof(name), "luma_row/%s", luma_kernels[i].name);
+        add_case(name, run_luma_row, bytes_luma, luma_kernels[i].row);
+    }
+
+    add_case("rgb_to_grey", run_rgb_to_grey, bytes_luma, NULL);
+    add_case("resize_image/grey", run_resize_grey, bytes_resize, NULL);
+    add_case("resize_image/yuyv", run_resize_yuyv, bytes_resize, NULL);
+    add_case("resize_rgb_to_grey", run_resize_rgb_to_grey, bytes_resize_rgb,
+             NULL);
+    add_case("resize_to_rgb/rgb", run_resize_to_rgb, bytes_resize_to_rgb,
+             NULL);
+    add_case("resize_to_rgb/yuyv", run_resize_yuyv_to_rgb, bytes_resize_to_rgb,
+             NULL);
+    add_case("decompress_jpeg", run_decompress_jpeg, bytes_jpeg, NULL);
+    add_case("map_glyphs", run_map_glyphs, bytes_glyphs, NULL);
+    add_case("map_braille", run_map_braille, bytes_braille, NULL);
+    add_case("dither/ordered", run_dither_ordered, bytes_luma, NULL);
+    add_case("dither/diffusion", run_dither_diffusion, bytes_luma, NULL);
+}
+
+static void alloc_image(image_t *img, int width, int height, int depth){
+
+    img->width = width;
+    img->height = height;
+    img->depth = depth;
+    img->stride = width * depth;
+    img->image = (uint8_t*)malloc((size_t)img->stride * height);
+
+    if (!img->image) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* a gradient with noise on top, so nothing is trivially predictable */
+static void init_buffers(struct buffers *b, int width, int height){
+
+    tjhandle handle;
+    uint32_t noise = 0x9e3779b9;
+    uint8_t *p;
+
+    b->width = width;
+    b->height = height;
+
+    alloc_image(&b->rgb, width, height, 3);
+    alloc_image(&b->grey, width, height, 1);
+    alloc_image(&b->yuyv, width, height, 2);
+    alloc_image(&b->out, width, height, 1);
+    alloc_image(&b->grid, GRID_WIDTH, GRID_HEIGHT, 1);
+    alloc_image(&b->colour, GRID_WIDTH, GRID_HEIGHT * 2, 3);
+
+    b->glyphs = (char*)malloc(pixels(b));
+    if (!b->glyphs) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    p = b->rgb.image;
+    for (size_t i = 0; i < pixels(b); i++) {
+        noise ^= noise << 13;
+        noise ^= noise >> 17;
+        noise ^= noise << 5;
+        p[0] = (i % width) + (noise & 31);
+        p[1] = (i / width) + (noise >> 5 & 31);
+        p[2] = noise >> 10;
+        b->grey.image[i] = LUMA(p[0], p[1], p[2]);
+        b->yuyv.image[i * 2] = b->grey.image[i];
+        b->yuyv.image[i * 2 + 1] = noise >> 20;
+        p += 3;
+    }
+
+    handle = tjInitCompress();
+    b->jpeg = NULL;
+    b->jpeg_size = 0;
+    if (!handle ||
+        -1 == tjCompress2(handle, b->rgb.image, width, 0, height, TJPF_RGB,
+                          &b->jpeg, &b->jpeg_size, TJSAMP_422, JPEG_QUALITY,
+                          TJFLAG_FASTDCT)) {
+        fprintf(stderr, "Can't compress the test frame\n");
+        exit(EXIT_FAILURE);
+    }
+    tjDestroy(handle);
+
+    /* the decoder's target is the whole frame, so it runs at full scale */
+    if (init_jpeg_decoder(&b->decoder, width, height, 1)) {
+        exit(EXIT_FAILURE);
+    }
+    set_jpeg_decoder_target(&b->decoder, width, height);
+}
+
+static void free_buffers(struct buffers *b){
+    free(b->rgb.image);
+    free(b->grey.image);
+    free(b->yuyv.image);
+    free(b->out.image);
+    free(b->grid.image);
+    free(b->colour.image);
+    free(b->glyphs);
+    tjFree(b->jpeg);
+    uninit_jpeg_decoder(&b->decoder);
+}
+
+/* every luma variant has to give the scalar reference's bytes exactly */
+static int check_luma_kernels(struct buffers *b){
+
+    uint8_t *reference = (uint8_t*)malloc(pixels(b));
+    int failed = 0;
+
+    if (!reference) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    luma_kernels[0].row(b->rgb.image, reference, pixels(b));
+
+    for (int i = 1; i < n_luma_kernels; i++) {
+        if (!luma_kernels[i].supported()) {
+            continue;
+        }
+
+        /* odd lengths and offsets reach the tail handling */
+        for (int n = 0; n < 67; n++) {
+            memset(b->out.image, 0, n + 1);
+            luma_kernels[i].row(b->rgb.image + 3 * n, b->out.image, n);
+            if (memcmp(b->out.image, reference + n, n) || b->out.image[n]) {
+                fprintf(stderr, "luma_row/%s differs from %s at %d pixels\n",
+                     luma_kernels[i].name, luma_kernels[0].name, n);
+                failed = 1;
+                break;
+            }
+        }
+
+        luma_kernels[i].row(b->rgb.image, b->out.image, pixels(b));
+        if (memcmp(b->out.image, reference, pixels(b))) {
+            fprintf(stderr, "luma_row/%s differs from %s\n",
+                 luma_kernels[i].name, luma_kernels[0].name);
+            failed = 1;
+        }
+    }
+
+    free(reference);
+
+    return failed;
+}
+
+static int compare_double(const void *a, const void *b){
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static void measure(struct bench_case *c, struct buffers *b){
+
+    double ns[SAMPLES];
+    double cycles[SAMPLES];
+    uint64_t t, start_ns, start_cycles;
+    long calls = 1;
+    struct measurement *m;
+
+    /* warm up, then find how many calls make up a sample */
+    c->run(b, c->row);
+    t = now_ns();
+    c->run(b, c->row);
+    t = now_ns() - t;
+    if (t < SAMPLE_NS) {
+        calls = SAMPLE_NS / (t ? t : 1);
+    }
+
+    for (int s = 0; s < SAMPLES; s++) {
+        start_ns = now_ns();
+        start_cycles = read_cycles();
+        for (long i = 0; i < calls; i++) {
+            c->run(b, c->row);
+        }
+        cycles[s] = (double)(read_cycles() - start_cycles) / calls;
+        ns[s] = (double)(now_ns() - start_ns) / calls;
+    }
+
+    qsort(ns, SAMPLES, sizeof(*ns), compare_double);
+    qsort(cycles, SAMPLES, sizeof(*cycles), compare_double);
+
+    m = &measurements[n_measurements++];
+    memcpy(m->name, c->name, sizeof(m->name));
+    m->width = b->width;
+    m->height = b->height;
+    m->ns_per_pixel = ns[SAMPLES / 2] / pixels(b);
+    m->cycles_per_pixel = cycles[SAMPLES / 2] / pixels(b);
+    m->gb_per_s = c->bytes(b) / ns[SAMPLES / 2];
+
+    if (HAVE_CYCLES) {
+        fprintf(report, "  %-24s %10.3f %10.3f %10.2f\n",
+            m->name, m->ns_per_pixel, m->cycles_per_pixel, m->gb_per_s);
+    }
+    else {
+        fprintf(report, "  %-24s %10.3f %10s %10.2f\n",
+            m->name, m->ns_per_pixel, "-", m->gb_per_s);
+    }
+}
+
+/* "name WxH ns_per_pixel" lines, # starts a comment */
+static void read_baseline(const char *name){
+
+    FILE *fp = fopen(name, "r");
+    char line[128];
+    struct baseline_entry *e;
+
+    if (!fp) {
+        fprintf(stderr, "Cannot open '%s'\n", name);
+        exit(EXIT_FAILURE);
+    }
+
+    while (n_baseline < MAX_BASELINE && fgets(line, sizeof(line), fp)) {
+        e = &baseline[n_baseline];
+        if ('#' == line[0]) {
+            continue;
+        }
+        if (4 == sscanf(line, "%31s %dx%d %lf", e->name, &e->width,
+                        &e->height, &e->ns_per_pixel)) {
+            n_baseline++;
+        }
+    }
+
+    fclose(fp);
+}
+
+static void write_baseline(const char *name){
+
+    FILE *fp = fopen(name, "w");
+    struct measurement *m;
+
+    if (!fp) {
+        fprintf(stderr, "Cannot create '%s'\n", name);
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(fp, "# kernel ns/pixel, written by kernel_bench -w\n");
+    for (int i = 0; i < n_measurements; i++) {
+        m = &measurements[i];
+        fprintf(fp, "%s %dx%d %.6f\n",
+            m->name, m->width, m->height, m->ns_per_pixel);
+    }
+
+    fclose(fp);
+}
+
+/* returns the number of kernels slower than the baseline by more than the
+   threshold, the ones missing from it are only reported */
+static int check_baseline(void){
+
+    struct measurement *m;
+    struct baseline_entry *e;
+    double change;
+    int regressions = 0;
+    int found;
+
+    fprintf(report, "against %s, %.1f%% allowed\n", baseline_name, threshold);
+
+    for (int i = 0; i < n_measurements; i++) {
+        m = &measurements[i];
+        found = 0;
+
+        for (int j = 0; j < n_baseline && !found; j++) {
+            e = &baseline[j];
+            if (strcmp(e->name, m->name) || e->width != m->width ||
+                e->height != m->height) {
+                continue;
+            }
+            found = 1;
+
+            change = (m->ns_per_pixel / e->ns_per_pixel - 1) * 100;
+            if (change > threshold) {
+                fprintf(report, "  %-24s %4dx%-4d %+7.1f%%  REGRESSION\n",
+                    m->name, m->width, m->height, change);
+                regressions++;
+            }
+            else {
+                fprintf(report, "  %-24s %4dx%-4d %+7.1f%%\n",
+                    m->name, m->width, m->height, change);
+            }
+        }
+
+        if (!found) {
+            fprintf(report, "  %-24s %4dx%-4d not in the baseline\n",
+                m->name, m->width, m->height);
+        }
+    }
+
+    return regressions;
+}
+
+static void write_json(const char *name){
+
+    FILE *fp = strcmp(name, "-") ? fopen(name, "w") : stdout;
+    struct measurement *m;
+
+    if (!fp) {
+        fprintf(stderr, "Cannot create '%s'\n", name);
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(fp, "{\n  \"threads\": %d,\n  \"kernels\": [\n", get_thread_n());
+
+    for (int i = 0; i < n_measurements; i++) {
+        m = &measurements[i];
+        fprintf(fp,
+            "    {\"name\": \"%s\", \"size\": \"%dx%d\", "
+            "\"ns_per_pixel\": %.6f, ",
+            m->name, m->width, m->height, m->ns_per_pixel);
+        if (HAVE_CYCLES) {
+            fprintf(fp, "\"cycles_per_pixel\": %.4f, ", m->cycles_per_pixel);
+        }
+        else {
+            fprintf(fp, "\"cycles_per_pixel\": null, ");
+        }
+        fprintf(fp, "\"gb_per_s\": %.3f}%s\n",
+            m->gb_per_s, i + 1 < n_measurements ? "," : "");
+    }
+
+    fprintf(fp, "  ]\n}\n");
+
+    if (fp != stdout) {
+        fclose(fp);
+    }
+}
+
+static void usage(FILE *fp, int argc, char **argv){
+
+    fprintf(fp,
+        "Usage: %s [options]\n\n"
+        "Options:\n"
+        "-s | --sizes list       Frame sizes [640x480,1280x720,1920x1080]\n"
+        "-k | --kernel name      Only run the kernels whose name contains this\n"
+        "-j | --threads n        Workers for the pooled kernels [1]\n"
+        "-b | --baseline file    Fail when a kernel got slower than in file\n"
+        "-t | --threshold pct    Slowdown allowed against the baseline [10]\n"
+        "-w | --write file       Save this run as a baseline\n"
+        "-o | --json file        Also write the results as JSON, - for stdout\n"
+        "-h | --help             Print this message\n"
+        "",
+        argv[0]
+    );
+}
+
+static const char short_options[] = "s:k:j:b:t:w:o:h";
+
+static const struct option long_options[] = {
+    { "sizes",      required_argument, NULL, 's' },
+    { "kernel",     required_argument, NULL, 'k' },
+    { "threads",    required_argument, NULL, 'j' },
+    { "baseline",   required_argument, NULL, 'b' },
+    { "threshold",  required_argument, NULL, 't' },
+    { "write",      required_argument, NULL, 'w' },
+    { "json",       required_argument, NULL, 'o' },
+    { "help",       no_argument,       NULL, 'h' },
+    { 0,            0,                 0,     0  }
+};
+
+static int parse_sizes(const char *arg){
+
+    int n = 0;
+    int used;
+
+    while (n < MAX_SIZES &&
+           2 == sscanf(arg, "%dx%d%n", &sizes[n].width, &sizes[n].height,
+                       &used)) {
+        if (sizes[n].width <= 0 || sizes[n].height <= 0) {
+            return 0;
+        }
+        n++;
+        arg += used;
+        if (',' != *arg++) {
+            return arg[-1] ? 0 : n;
+        }
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv){
+
+    struct buffers b;
+    int threads = 1;
+    int failed = 0;
+    char *end;
+    int c;
+
+    while (-1 != (c = getopt_long(argc, argv, short_options, long_options,
+                                  NULL))) {
+        switch (c) {
+        case 's':
+            n_sizes = parse_sizes(optarg);
+            if (!n_sizes) {
+                usage(stderr, argc, argv);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'k':
+            filter = optarg;
+            break;
+
+        case 'j':
+            threads = atoi(optarg);
+            break;
+
+        case 'b':
+            baseline_name = optarg;
+            break;
+
+        case 't':
+            threshold = strtod(optarg, &end);
+            if (end == optarg || *end || threshold < 0) {
+                usage(stderr, argc, argv);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'w':
+            write_name = optarg;
+            break;
+
+        case 'o':
+            json_name = optarg;
+            break;
+
+        case 'h':
+            usage(stdout, argc, argv);
+            exit(EXIT_SUCCESS);
+
+        default:
+            usage(stderr, argc, argv);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    report = json_name && !strcmp(json_name, "-") ? stderr : stdout;
+
+    if (baseline_name) {
+        read_baseline(baseline_name);
+    }
+
+    set_thread_n(threads > 0 ? threads : 1);
+    init_luma();
+    init_cases();
+
+    measurements = (struct measurement*)calloc(n_sizes * n_cases,
+                                               sizeof(*measurements));
+    if (!measurements) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int s = 0; s < n_sizes; s++) {
+        init_buffers(&b, sizes[s].width, sizes[s].height);
+
+        if (check_luma_kernels(&b)) {
+            failed = 1;
+        }
+
+        fprintf(report, "%dx%d, %d thread%s\n", b.width, b.height, get_thread_n(),
+            1 == get_thread_n() ? "" : "s");
+        fprintf(report, "  %-24s %10s %10s %10s\n",
+            "kernel", "ns/px", "cycles/px", "GB/s");
+
+        for (int i = 0; i < n_cases; i++) {
+            measure(&cases[i], &b);
+        }
+        fprintf(report, "\n");
+
+        free_buffers(&b);
+    }
+
+    if (write_name) {
+        write_baseline(write_name);
+    }
+
+    if (json_name) {
+        write_json(json_name);
+    }
+
+    if (baseline_name && check_baseline()) {
+        failed = 1;
+    }
+
+    uninit_resize();
+    pool_uninit();
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,544 @@
+/*
+ * headless end-to-end benchmark, runs the frames of a recorded (or generated)
+ * MJPEG clip through the viewer's grey path: a scaled decode of the whole
+ * frame straight to grey, resize and dither, then glyph mapping, and reports
+ * every stage's throughput and latency percentiles
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <getopt.h>
+#include <turbojpeg.h>
+#include <linux/videodev2.h>
+
+#include "../src/include/img.h"
+#include "../src/include/disp.h"
+#include "../src/include/pool.h"
+#include "../src/include/source.h"
+
+/* frames run before the measured ones, they build the resize tables and
+   wake the workers up */
+#define WARMUP_FRAMES   5
+#define MAX_MATRIX      16
+#define JPEG_QUALITY    85
+
+/* resize covers the dithering too, as in the viewer's stats */
+enum stage { DECODE, RESIZE, GLYPHS, TOTAL, N_STAGES };
+
+static const char *stage_names[N_STAGES] = {
+    "decode", "resize", "glyphs", "total"
+};
+
+struct size {
+    int width;
+    int height;
+};
+
+struct clip {
+    int             width;
+    int             height;
+    int             n_frames;
+    uint8_t         **data;
+    size_t          *size;
+};
+
+struct stage_result {
+    double  fps;
+    double  p50_ms;
+    double  p99_ms;
+};
+
+struct result {
+    struct size         source;
+    struct size         terminal;
+    int                 threads;
+    int                 frames;
+    struct stage_result stages[N_STAGES];
+};
+
+static struct size  sources[MAX_MATRIX] = {
+    { 640, 480 }, { 1280, 720 }, { 1920, 1080 }
+};
+static int          n_sources = 3;
+static struct size  terminals[MAX_MATRIX] = {
+    { 80, 24 }, { 160, 48 }, { 240, 67 }
+};
+static int          n_terminals = 3;
+static int          threads[MAX_MATRIX] = { 1, 2, 4 };
+static int          n_threads = 3;
+static int          n_frames = 100;
+static const char   *clip_name;
+static const char   *json_name;
+static enum dither_mode dither;
+static const char   *dither_name = "none";
+
+static struct result *results;
+static int          n_results;
+
+/* the human readable report, moves to stderr when the JSON takes stdout */
+static FILE         *report;
+
+static uint64_t now_ns(void){
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/* a moving gradient with some noise on top, so the encoder has detail to
+   keep and the decoder has real work to do */
+static void make_clip(struct clip *clip, struct size size, int frames){
+
+    tjhandle handle = tjInitCompress();
+    uint8_t *rgb = (uint8_t*)malloc((size_t)size.width * size.height * 3);
+    unsigned long jpeg_size;
+    uint32_t noise = 0x12345678;
+    uint8_t *p;
+
+    clip->width = size.width;
+    clip->height = size.height;
+    clip->n_frames = frames;
+    clip->data = (uint8_t**)calloc(frames, sizeof(*clip->data));
+    clip->size = (size_t*)calloc(frames, sizeof(*clip->size));
+
+    if (!handle || !rgb || !clip->data || !clip->size) {
+        fprintf(stderr, "Can't generate the clip\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int f = 0; f < frames; f++) {
+        p = rgb;
+        for (int y = 0; y < size.height; y++) {
+            for (int x = 0; x < size.width; x++) {
+                noise ^= noise << 13;
+                noise ^= noise >> 17;
+                noise ^= noise << 5;
+                *p++ = (x + f * 4) + (noise & 15);
+                *p++ = (y + f * 2) + (noise >> 4 & 15);
+                *p++ = ((x ^ y) >> 2) + (noise >> 8 & 15);
+            }
+        }
+
+        jpeg_size = 0;
+        if (-1 == tjCompress2(handle, rgb, size.width, 0, size.height,
+                              TJPF_RGB, &clip->data[f], &jpeg_size,
+                              TJSAMP_422, JPEG_QUALITY, TJFLAG_FASTDCT)) {
+            fprintf(stderr, "jpeg error: %s\n", tjGetErrorStr2(handle));
+            exit(EXIT_FAILURE);
+        }
+        clip->size[f] = jpeg_size;
+    }
+
+    free(rgb);
+    tjDestroy(handle);
+}
+
+static void free_clip(struct clip *clip){
+
+    /* a recording's frames point into its mapping */
+    if (!clip_name) {
+        for (int f = 0; f < clip->n_frames; f++) {
+            tjFree(clip->data[f]);
+        }
+    }
+    free(clip->data);
+    free(clip->size);
+}
+
+/* take every frame of a recording, they stay valid in the mapping until the
+   source is closed */
+static void load_clip(struct clip *clip){
+
+    struct frame_format fmt;
+    struct frame frame;
+    int capacity = 0;
+
+    source_config.replay = clip_name;
+    source_config.fast = 1;
+    file_source.open();
+    file_source.init();
+    file_source.start();
+    file_source.format(&fmt);
+
+    if (V4L2_PIX_FMT_MJPEG != fmt.pixelformat) {
+        fprintf(stderr, "%s: only MJPEG recordings can be benchmarked\n",
+             clip_name);
+        exit(EXIT_FAILURE);
+    }
+
+    memset(clip, 0, sizeof(*clip));
+    clip->width = fmt.width;
+    clip->height = fmt.height;
+
+    while (-1 != file_source.wait(0)) {
+        if (!file_source.get(&frame)) {
+            continue;
+        }
+        if (clip->n_frames == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            clip->data = realloc(clip->data, capacity * sizeof(*clip->data));
+            clip->size = realloc(clip->size, capacity * sizeof(*clip->size));
+            if (!clip->data || !clip->size) {
+                fprintf(stderr, "Out of memory\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        clip->data[clip->n_frames] = frame.data;
+        clip->size[clip->n_frames] = frame.size;
+        clip->n_frames++;
+        file_source.put(&frame);
+    }
+}
+
+static int compare_ns(const void *a, const void *b){
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+/* nearest rank, the samples get sorted */
+static double percentile_ms(uint64_t *samples, int n, int p){
+    qsort(samples, n, sizeof(*samples), compare_ns);
+    return samples[(p * (n - 1) + 50) / 100] / 1e6;
+}
+
+static void run(struct clip *clip, struct size terminal, int n_workers){
+
+    jpeg_decoder_t decoder;
+    image_t decoded;
+    image_t grid;
+    /* the viewer's view before any zoom or pan */
+    roi_t roi = { 0, 0, ROI_ONE, ROI_ONE };
+    char *glyphs;
+    uint64_t *samples[N_STAGES];
+    uint64_t t[N_STAGES];
+    uint8_t curve[256];
+    uint64_t sum;
+    struct result *r;
+    int frames = clip->n_frames;
+    int f;
+
+    set_thread_n(n_workers);
+
+    if (init_jpeg_decoder(&decoder, clip->width, clip->height, 1)) {
+        exit(EXIT_FAILURE);
+    }
+    set_jpeg_decoder_target(&decoder, terminal.width, terminal.height);
+
+    grid.width = terminal.width;
+    grid.height = terminal.height;
+    grid.depth = 1;
+    grid.stride = terminal.width;
+    grid.image = (uint8_t*)malloc((size_t)terminal.width * terminal.height);
+    glyphs = (char*)malloc((size_t)terminal.width * terminal.height);
+
+    for (int s = 0; s < N_STAGES; s++) {
+        samples[s] = (uint64_t*)malloc(frames * sizeof(uint64_t));
+        if (!samples[s]) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (!grid.image || !glyphs) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (f = -WARMUP_FRAMES; f < frames; f++) {
+        int i = (f % frames + frames) % frames;
+
+        t[0] = now_ns();
+        if (decompress_jpeg_roi(&decoder, clip->data[i], clip->size[i],
+                                &roi, &decoded)) {
+            exit(EXIT_FAILURE);
+        }
+        t[1] = now_ns();
+
+        resize_image(&decoded, &grid);
+        get_tone(curve);
+        dither_image(&grid, get_glyph_levels(), curve, dither);
+        t[2] = now_ns();
+
+        map_glyphs(grid.image, glyphs, grid.height, grid.width, grid.stride);
+        t[3] = now_ns();
+
+        if (f < 0) {
+            continue;
+        }
+
+        for (int s = 0; s < TOTAL; s++) {
+            samples[s][f] = t[s + 1] - t[s];
+        }
+        samples[TOTAL][f] = t[TOTAL] - t[0];
+    }
+
+    r = &results[n_results++];
+    r->source.width = clip->width;
+    r->source.height = clip->height;
+    r->terminal = terminal;
+    r->threads = get_thread_n();
+    r->frames = frames;
+
+    for (int s = 0; s < N_STAGES; s++) {
+        sum = 0;
+        for (f = 0; f < frames; f++) {
+            sum += samples[s][f];
+        }
+        r->stages[s].fps = sum ? frames * 1e9 / sum : 0;
+        r->stages[s].p50_ms = percentile_ms(samples[s], frames, 50);
+        r->stages[s].p99_ms = percentile_ms(samples[s], frames, 99);
+        free(samples[s]);
+    }
+
+    fprintf(report, "source %dx%d, terminal %dx%d, %d thread%s, %d frames\n",
+        r->source.width, r->source.height,
+        terminal.width, terminal.height,
+        r->threads, 1 == r->threads ? "" : "s", frames);
+    fprintf(report, "  %-8s %12s %10s %10s\n", "stage", "frames/s", "p50 ms", "p99 ms");
+    for (int s = 0; s < N_STAGES; s++) {
+        fprintf(report, "  %-8s %12.1f %10.3f %10.3f\n", stage_names[s],
+            r->stages[s].fps, r->stages[s].p50_ms, r->stages[s].p99_ms);
+    }
+    fprintf(report, "\n");
+
+    uninit_jpeg_decoder(&decoder);
+    free(grid.image);
+    free(glyphs);
+}
+
+static void write_json(const char *name){
+
+    FILE *fp = strcmp(name, "-") ? fopen(name, "w") : stdout;
+    struct result *r;
+
+    if (!fp) {
+        fprintf(stderr, "Cannot create '%s'\n", name);
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(fp, "{\n  \"clip\": \"%s\",\n  \"dither\": \"%s\",\n"
+        "  \"runs\": [\n", clip_name ? clip_name : "synthetic", dither_name);
+
+    for (int i = 0; i < n_results; i++) {
+        r = &results[i];
+        fprintf(fp,
+            "    {\"source\": \"%dx%d\", \"terminal\": \"%dx%d\", "
+            "\"threads\": %d, \"frames\": %d, \"stages\": {",
+            r->source.width, r->source.height,
+            r->terminal.width, r->terminal.height,
+            r->threads, r->frames);
+        for (int s = 0; s < N_STAGES; s++) {
+            fprintf(fp,
+                "%s\n      \"%s\": {\"fps\": %.2f, \"p50_ms\": %.4f, "
+                "\"p99_ms\": %.4f}",
+                s ? "," : "", stage_names[s],
+                r->stages[s].fps, r->stages[s].p50_ms, r->stages[s].p99_ms);
+        }
+        fprintf(fp, "\n    }}%s\n", i + 1 < n_results ? "," : "");
+    }
+
+    fprintf(fp, "  ]\n}\n");
+
+    if (fp != stdout) {
+        fclose(fp);
+    }
+}
+
+/* "640x480,1280x720" */
+static int parse_sizes(const char *arg, struct size *sizes){
+
+    int n = 0;
+    int used;
+
+    while (n < MAX_MATRIX &&
+           2 == sscanf(arg, "%dx%d%n", &sizes[n].width, &sizes[n].height,
+                       &used)) {
+        if (sizes[n].width <= 0 || sizes[n].height <= 0) {
+            return 0;
+        }
+        n++;
+        arg += used;
+        if (',' != *arg++) {
+            return arg[-1] ? 0 : n;
+        }
+    }
+
+    return 0;
+}
+
+/* "1,2,4" */
+static int parse_counts(const char *arg, int *counts){
+
+    int n = 0;
+    char *end;
+
+    while (n < MAX_MATRIX) {
+        counts[n] = strtol(arg, &end, 10);
+        if (end == arg || counts[n] < 1) {
+            return 0;
+        }
+        n++;
+        if (!*end) {
+            return n;
+        }
+        if (',' != *end) {
+            return 0;
+        }
+        arg = end + 1;
+    }
+
+    return 0;
+}
+
+static void usage(FILE *fp, int argc, char **argv){
+
+    fprintf(fp,
+        "Usage: %s [options]\n\n"
+        "Options:\n"
+        "-i | --input file       MJPEG recording (see main -w) to run, a\n"
+        "                        generated clip is used otherwise\n"
+        "-s | --sources list     Generated clip sizes [640x480,1280x720,\n"
+        "                        1920x1080]\n"
+        "-n | --frames n         Frames in a generated clip [100]\n"
+        "-t | --terminals list   Terminal sizes [80x24,160x48,240x67]\n"
+        "-j | --threads list     Worker counts [1,2,4]\n"
+        "-q | --dither mode      Dither as the viewer's -q: none, ordered or\n"
+        "                        diffusion [none]\n"
+        "-o | --json file        Also write the results as JSON, - for stdout\n"
+        "-h | --help             Print this message\n"
+        "",
+        argv[0]
+    );
+}
+
+static const char short_options[] = "i:s:n:t:j:q:o:h";
+
+static const struct option long_options[] = {
+    { "input",      required_argument, NULL, 'i' },
+    { "sources",    required_argument, NULL, 's' },
+    { "frames",     required_argument, NULL, 'n' },
+    { "terminals",  required_argument, NULL, 't' },
+    { "threads",    required_argument, NULL, 'j' },
+    { "dither",     required_argument, NULL, 'q' },
+    { "json",       required_argument, NULL, 'o' },
+    { "help",       no_argument,       NULL, 'h' },
+    { 0,            0,                 0,     0  }
+};
+
+int main(int argc, char **argv){
+
+    struct clip clip;
+    int c;
+
+    while (-1 != (c = getopt_long(argc, argv, short_options, long_options,
+                                  NULL))) {
+        switch (c) {
+        case 'i':
+            clip_name = optarg;
+            break;
+
+        case 's':
+            n_sources = parse_sizes(optarg, sources);
+            break;
+
+        case 'n':
+            n_frames = atoi(optarg);
+            break;
+
+        case 't':
+            n_terminals = parse_sizes(optarg, terminals);
+            break;
+
+        case 'j':
+            n_threads = parse_counts(optarg, threads);
+            break;
+
+        case 'q':
+            dither_name = optarg;
+            if (!strcmp(optarg, "none")) {
+                dither = DITHER_NONE;
+            }
+            else if (!strcmp(optarg, "ordered")) {
+                dither = DITHER_ORDERED;
+            }
+            else if (!strcmp(optarg, "diffusion")) {
+                dither = DITHER_DIFFUSION;
+            }
+            else {
+                usage(stderr, argc, argv);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'o':
+            json_name = optarg;
+            break;
+
+        case 'h':
+            usage(stdout, argc, argv);
+            exit(EXIT_SUCCESS);
+
+        default:
+            usage(stderr, argc, argv);
+            exit(EXIT_FAILURE);
+        }
+
+        if (!n_sources || !n_terminals || !n_threads || n_frames < 1) {
+            usage(stderr, argc, argv);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (clip_name) {
+        n_sources = 1;
+    }
+
+    /* a dithered grid comes with the tone curve applied */
+    set_pretoned(DITHER_NONE != dither);
+
+    report = json_name && !strcmp(json_name, "-") ? stderr : stdout;
+
+    results = (struct result*)calloc(n_sources * n_terminals * n_threads,
+                                     sizeof(*results));
+    if (!results) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int s = 0; s < n_sources; s++) {
+        if (clip_name) {
+            load_clip(&clip);
+        }
+        else {
+            make_clip(&clip, sources[s], n_frames);
+        }
+
+        for (int t = 0; t < n_terminals; t++) {
+            for (int j = 0; j < n_threads; j++) {
+                run(&clip, terminals[t], threads[j]);
+            }
+        }
+
+        free_clip(&clip);
+    }
+
+    if (clip_name) {
+        file_source.close();
+    }
+
+    if (json_name) {
+        write_json(json_name);
+    }
+
+    uninit_resize();
+    pool_uninit();
+
+    return 0;
+}
@@ -1,27 +1,172 @@
 #include "include/disp.h"
+#include "include/img.h"
 #include <ncurses.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
 
 struct screen{
     WINDOW* window;
     uint32_t max_x;
     uint32_t max_y;
+
+    /* glyphs currently on the terminal and the ones for the frame being
+       drawn, both max_x * max_y */
+    char *shown;
+    char *glyphs;
+    size_t cells;   /* room in both, with headroom for resizes */
+    int  valid;     /* shown matches the terminal */
+    size_t shown_rows;  /* the shape shown was drawn with */
+    size_t shown_width;
+
+    /* raw backend only, the whole frame as it goes to the tty */
+    char            *out;
+    size_t          out_size;
+    struct termios  saved_termios;
 };
 
 struct screen main_window;
 
-static const char palette[] = {' ', '.', ':', '-', '=', '+', '*', '#', '%', '@'};
-//static char palette[] = {' ', '.', '_', '+', '&', '#'};
-//static char palette[] = {'$', '@', 'B', '%', '8', '&', 'W', 'M', '#', '*', 'o',
-//    'a', 'h', 'k', 'b', 'd', 'p', 'q', 'w', 'm', 'Z', 'O', '0', 'Q', 'L', 'C',
-//    'J', 'U', 'Y', 'X', 'z', 'c', 'v', 'u', 'n', 'x', 'r', 'j', 'f', 't', '/',
-//    '\\', '|', '(', ')', '1', '{', '}', '[', ']', '?', '-', '_', '+', '~', '<',
-//    '>', 'i', '!', 'l', 'I', ';', ':', ',', '\"', '^', '`', '\'', '.', ' '};
+/* the two ways of getting glyphs onto the terminal, ncurses or a single
+   write() of the whole frame as escape sequences */
+struct display_backend {
+    void (*init)(void);
+    void (*uninit)(void);
+    void (*draw)(size_t rows, size_t width);
+    int  (*key)(void);
+    void (*resize)(void);   /* max_x and max_y changed */
+};
 
-static const uint8_t intervals = sizeof(palette)/sizeof(char);
+static const struct display_backend *backend;
 
-void init_window(){
+/* status line drawn over the bottom row, NULL when hidden */
+static const char *hud;
+
+/* frames are RGB and drawn as half blocks, see set_colour_output() */
+static enum colour_mode colour;
+
+/* frames are grey with 2x4 pixels a cell drawn as braille patterns */
+static int braille;
+
+/* UTF-8 of U+2800 + every dot pattern */
+static char braille_utf8[256][3];
+
+/* SGR parameter text of every byte value */
+static char     decimal[256][4];
+static uint8_t  decimal_length[256];
+
+/* xterm 256 colour palette index of every colour cut to 5 bits a channel */
+#define QUANT_BITS  5
+static uint8_t  quantized[1 << (3 * QUANT_BITS)];
+
+/* the glyphs from sparse to dense, a dark pixel gets the first one */
+static const struct {
+    const char *name;
+    const char *glyphs;
+} palettes[] = {
+    { "ascii",  " .:-=+*#%@" },
+    { "short",  " ._+&#" },
+    { "long",   " .'`^\",:;Il!i><~+_-?][}{1)(|\\/tfjrxnuvczXYUJCLQ0OZmwqp"
+                "dbkhao*#MW&8%B@$" },
+};
+
+#define MAX_LEVELS 128
+
+static char     palette[MAX_LEVELS + 1] = " .:-=+*#%@";
+static int      intervals = 10;
+
+/* tone curve, the picture's grey (or colour channel) levels are put
+   through before anything is drawn */
+#define CONTRAST_STEP   1.1
+#define MAX_CONTRAST    8.0
+#define BRIGHTNESS_STEP 0.05
+
+static double   gamma_value = 1.0;
+static double   contrast = 1.0;
+static double   brightness = 0.0;
+static int      pretoned;           /* the frames come with it applied */
+
+/* the tone curve, the main thread's own, the processing threads copy it
+   out of the words once a frame, the count is odd while they're rewritten,
+   so a copy never mixes two curves */
+static uint8_t          tone[256];
+static atomic_uint      tone_seq;
+static atomic_uint_least32_t tone_words[256 / 4];
+
+/* everything a grey level turns into, rebuilt when the palette or the tone
+   change, so drawing a cell is a single lookup */
+static char     glyph_of[256];
+static uint8_t  dot_of[256];        /* braille, 1 when lit */
+
+/* the tone curve and what every level maps to through it, frames that
+   come toned already skip it on the way to the glyphs and dots */
+static void build_tables(void){
+
+    unsigned int seq = atomic_load_explicit(&tone_seq, memory_order_relaxed);
+    uint_least32_t word;
+    double v;
+    int level;
+
+    for (int i = 0; i < 256; i++) {
+        v = (i / 255.0 - 0.5) * contrast + 0.5 + brightness;
+        v = v < 0 ? 0 : v > 1 ? 1 : v;
+        tone[i] = (uint8_t)(pow(v, 1.0 / gamma_value) * 255 + 0.5);
+
+        level = pretoned ? i : tone[i];
+        glyph_of[i] = palette[level * intervals >> 8];
+        dot_of[i] = level >> 7;
+    }
+
+    /* only the main thread writes, no two of these overlap */
+    atomic_store_explicit(&tone_seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    for (int i = 0; i < 256 / 4; i++) {
+        memcpy(&word, tone + i * 4, 4);
+        atomic_store_explicit(&tone_words[i], word, memory_order_relaxed);
+    }
+    atomic_store_explicit(&tone_seq, seq + 2, memory_order_release);
+}
+
+/* unchanged runs shorter than this are redrawn rather than skipped, a cursor
+   move costs about as many bytes */
+#define MIN_SKIP 8
+
+/* past this share of changed cells (in percent) every row is redrawn whole,
+   one call per row is cheaper than many short spans */
+#define FULL_REDRAW_PERCENT 50
+
+static void alloc_grids(void){
+
+    size_t cells = main_window.max_x * main_window.max_y;
+
+    main_window.valid = 0;
+
+    if (cells <= main_window.cells) {
+        return;
+    }
+
+    cells = WITH_HEADROOM(cells);
+
+    free(main_window.shown);
+    free(main_window.glyphs);
+    main_window.shown = (char*)malloc(cells);
+    main_window.glyphs = (char*)malloc(cells);
+    main_window.cells = cells;
+
+    if (!main_window.shown || !main_window.glyphs) {
+        backend->uninit();
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void ncurses_init(void){
     /* should return stdscr */
     main_window.window = initscr();
     getmaxyx(
@@ -31,6 +176,7 @@ void init_window(){
     );
 
     if (!main_window.max_x || !main_window.max_y) {
+        endwin();
         fprintf(stderr, "At least one terminal dimension is equal to 0\n");
         exit(EXIT_FAILURE);
     }
@@ -40,21 +186,758 @@ void init_window(){
     nodelay(main_window.window, 1);
 }
 
-void uninit_window(){
+static void ncurses_uninit(void){
     endwin();
 }
 
+static int ncurses_key(void){
+    return wgetch(stdscr);
+}
+
+static void ncurses_resize(void){
+    resizeterm(main_window.max_y, main_window.max_x);
+    clear();
+}
+
+/* draw the changed spans of one row */
+static void draw_row_diff(int y, const char *new, const char *old, int width){
+
+    int x = 0;
+    int start, end;
+
+    while (x < width) {
+        while (x < width && new[x] == old[x]) {
+            x++;
+        }
+        if (x == width) {
+            break;
+        }
+
+        /* extend the span over short unchanged runs */
+        start = x;
+        end = x;
+        while (x < width) {
+            if (new[x] != old[x]) {
+                end = ++x;
+            }
+            else if (x - end < MIN_SKIP) {
+                x++;
+            }
+            else {
+                break;
+            }
+        }
+
+        mvaddnstr(y, start, new + start, end - start);
+    }
+}
+
+static void ncurses_draw(size_t rows, size_t width){
+
+    size_t changed = 0;
+    int y;
+
+    if (main_window.valid) {
+        for (size_t i = 0; i < rows * width; i++) {
+            changed += main_window.glyphs[i] != main_window.shown[i];
+        }
+    }
+
+    if (!main_window.valid ||
+        changed * 100 > rows * width * FULL_REDRAW_PERCENT) {
+        /* most rows changed, redraw each of them in one go */
+        for (y = 0; y < rows; y++) {
+            mvaddnstr(y, 0, main_window.glyphs + y * width, width);
+        }
+    }
+    else {
+        for (y = 0; y < rows; y++) {
+            draw_row_diff(
+                y,
+                main_window.glyphs + y * width,
+                main_window.shown + y * width,
+                width
+            );
+        }
+    }
+
+    refresh();
+}
+
+/* write it all, the tty may take a large frame in several goes */
+static void write_all(const char *buf, size_t n){
+
+    ssize_t r;
+
+    while (n) {
+        r = write(STDOUT_FILENO, buf, n);
+        if (-1 == r) {
+            if (EINTR == errno || EAGAIN == errno) {
+                continue;
+            }
+            return;
+        }
+        buf += r;
+        n -= r;
+    }
+}
+
+#define ESC "\x1b"
+#define SYNC_BEGIN      ESC "[?2026h"   /* synchronized update, DEC 2026 */
+#define SYNC_END        ESC "[?2026l"
+#define CURSOR_HOME     ESC "[H"
+#define CLEAR_SCREEN    ESC "[2J"
+#define ENTER_SCREEN    ESC "[?1049h" ESC "[?25l" CLEAR_SCREEN
+#define LEAVE_SCREEN    ESC "[?25h" ESC "[?1049l"
+#define SGR_RESET       ESC "[0m"
+
+#define UPPER_HALF      "\xe2\x96\x80"    /* U+2580, UTF-8 */
+#define LOWER_HALF      "\xe2\x96\x84"
+#define FULL_BLOCK      "\xe2\x96\x88"
+
+/* most one colour cell takes, both colours in one SGR and a 3 byte glyph */
+#define COLOUR_CELL_MAX (sizeof(ESC "[38;2;255;255;255;48;2;255;255;255m") - \
+                         1 + sizeof(UPPER_HALF) - 1)
+
+#define APPEND(p, s) (memcpy(p, s, sizeof(s) - 1), (p) + sizeof(s) - 1)
+
+/* cursor home, every row and a line break between them, all framed by the
+   synchronized update markers, in colour the resets around the HUD too */
+static void alloc_out(void){
+
+    size_t cell = colour ? COLOUR_CELL_MAX : braille ? 3 : 1;
+    size_t size = sizeof(SYNC_BEGIN CURSOR_HOME SGR_RESET SGR_RESET SYNC_END) +
+        (size_t)main_window.max_y * (main_window.max_x * cell + 2);
+
+    if (size <= main_window.out_size) {
+        return;
+    }
+
+    free(main_window.out);
+    main_window.out_size = WITH_HEADROOM(size);
+    main_window.out = (char*)malloc(main_window.out_size);
+
+    if (!main_window.out) {
+        write_all(LEAVE_SCREEN, sizeof(LEAVE_SCREEN) - 1);
+        tcsetattr(STDIN_FILENO, TCSAFLUSH, &main_window.saved_termios);
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void raw_init(void){
+
+    struct termios t;
+
+    if (get_terminal_xy(&main_window.max_x, &main_window.max_y)) {
+        fprintf(stderr, "Can't get the terminal size\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (-1 == tcgetattr(STDIN_FILENO, &main_window.saved_termios)) {
+        fprintf(stderr, "stdin is not a terminal\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* no echo, no line buffering, reads return at once like nodelay() */
+    t = main_window.saved_termios;
+    cfmakeraw(&t);
+    t.c_cc[VMIN] = 0;
+    t.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &t);
+
+    alloc_out();
+
+    write_all(ENTER_SCREEN, sizeof(ENTER_SCREEN) - 1);
+}
+
+static void raw_uninit(void){
+    write_all(LEAVE_SCREEN, sizeof(LEAVE_SCREEN) - 1);
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &main_window.saved_termios);
+    free(main_window.out);
+    main_window.out = NULL;
+    main_window.out_size = 0;
+}
+
+static int raw_key(void){
+
+    unsigned char c;
+
+    if (1 != read(STDIN_FILENO, &c, 1)) {
+        return ERR;
+    }
+
+    return c;
+}
+
+static void raw_resize(void){
+    alloc_out();
+    write_all(CLEAR_SCREEN, sizeof(CLEAR_SCREEN) - 1);
+}
+
+static void raw_draw(size_t rows, size_t width){
+
+    char *p = main_window.out;
+
+    p = APPEND(p, SYNC_BEGIN CURSOR_HOME);
+    for (size_t y = 0; y < rows; y++) {
+        if (y) {
+            p = APPEND(p, "\r\n");
+        }
+        memcpy(p, main_window.glyphs + y * width, width);
+        p += width;
+    }
+    p = APPEND(p, SYNC_END);
+
+    write_all(main_window.out, p - main_window.out);
+}
+
+static char *append_colour(char *p, char ground, int c){
+
+    *p++ = ground;
+    *p++ = '8';
+    *p++ = ';';
+
+    if (COLOUR_256 == colour) {
+        *p++ = '5';
+        *p++ = ';';
+        memcpy(p, decimal[c], 3);
+        return p + decimal_length[c];
+    }
+
+    *p++ = '2';
+    for (int shift = 16; shift >= 0; shift -= 8) {
+        *p++ = ';';
+        memcpy(p, decimal[c >> shift & 0xff], 3);
+        p += decimal_length[c >> shift & 0xff];
+    }
+
+    return p;
+}
+
+/* only the colours that differ from the ones in effect are sent, both in a
+   single sequence, a negative fg doesn't matter */
+static char *append_sgr(char *p, int fg, int bg, int *shown_fg, int *shown_bg){
+
+    int set_fg = fg >= 0 && fg != *shown_fg;
+    int set_bg = bg != *shown_bg;
+
+    if (!set_fg && !set_bg) {
+        return p;
+    }
+
+    p = APPEND(p, ESC "[");
+    if (set_fg) {
+        p = append_colour(p, '3', fg);
+        *shown_fg = fg;
+    }
+    if (set_fg && set_bg) {
+        *p++ = ';';
+    }
+    if (set_bg) {
+        p = append_colour(p, '4', bg);
+        *shown_bg = bg;
+    }
+    *p++ = 'm';
+
+    return p;
+}
+
+static inline int cell_colour(const uint8_t *p, const uint8_t *curve){
+
+    int r = curve[p[0]];
+    int g = curve[p[1]];
+    int b = curve[p[2]];
+
+    if (COLOUR_256 == colour) {
+        return quantized[(r >> (8 - QUANT_BITS)) << (2 * QUANT_BITS) |
+                         (g >> (8 - QUANT_BITS)) << QUANT_BITS |
+                         b >> (8 - QUANT_BITS)];
+    }
+
+    return r << 16 | g << 8 | b;
+}
+
+/* a cell for every two rows of RGB pixels, the top one in the upper half
+   block, written whole in one go like raw_draw() */
+static void draw_colour(
+    const uint8_t *frame,
+    size_t rows,
+    size_t width,
+    size_t line_width
+){
+
+    char *p = main_window.out;
+    const uint8_t *top, *bottom;
+    size_t length;
+    int fg = -1;
+    int bg = -1;
+    /* the main thread builds the curve, it can't change under the loop */
+    const uint8_t *curve = tone;
+    int t, b;
+
+    p = APPEND(p, SYNC_BEGIN CURSOR_HOME);
+    for (size_t y = 0; y < rows; y++) {
+        if (y) {
+            p = APPEND(p, "\r\n");
+        }
+
+        if (hud && y == rows - 1) {
+            p = APPEND(p, SGR_RESET);
+            length = strlen(hud);
+            length = length < width ? length : width;
+            memcpy(p, hud, length);
+            memset(p + length, ' ', width - length);
+            p += width;
+            break;
+        }
+
+        top = frame + 2 * y * line_width * 3;
+        bottom = top + line_width * 3;
+
+        /* mirrored like map_glyphs() */
+        for (size_t x = 0; x < width; x++) {
+            t = cell_colour(top + (line_width - 1 - x) * 3, curve);
+            b = cell_colour(bottom + (line_width - 1 - x) * 3, curve);
+
+            if (t == b) {
+                if (t == fg && t != bg) {
+                    p = APPEND(p, FULL_BLOCK);
+                }
+                else {
+                    p = append_sgr(p, -1, t, &fg, &bg);
+                    *p++ = ' ';
+                }
+            }
+            else if ((fg != b) + (bg != t) < (fg != t) + (bg != b)) {
+                /* the other half block needs fewer colour changes */
+                p = append_sgr(p, b, t, &fg, &bg);
+                p = APPEND(p, LOWER_HALF);
+            }
+            else {
+                p = append_sgr(p, t, b, &fg, &bg);
+                p = APPEND(p, UPPER_HALF);
+            }
+        }
+    }
+    p = APPEND(p, SGR_RESET SYNC_END);
+
+    write_all(main_window.out, p - main_window.out);
+}
+
+/* every row of cells on its own line, the HUD over the last one */
+static void draw_braille(
+    const uint8_t *frame,
+    size_t rows,
+    size_t width,
+    size_t line_width
+){
+
+    char *p = main_window.out;
+    size_t length;
+
+    p = APPEND(p, SYNC_BEGIN CURSOR_HOME);
+    for (size_t y = 0; y < rows; y++) {
+        if (y) {
+            p = APPEND(p, "\r\n");
+        }
+
+        if (hud && y == rows - 1) {
+            length = strlen(hud);
+            length = length < width ? length : width;
+            memcpy(p, hud, length);
+            memset(p + length, ' ', width - length);
+            p += width;
+            break;
+        }
+
+        p = map_braille(frame + 4 * y * line_width, p, 1, width, line_width);
+    }
+    p = APPEND(p, SYNC_END);
+
+    write_all(main_window.out, p - main_window.out);
+}
+
+static const struct display_backend ncurses_backend = {
+    ncurses_init,
+    ncurses_uninit,
+    ncurses_draw,
+    ncurses_key,
+    ncurses_resize
+};
+
+static const struct display_backend raw_backend = {
+    raw_init,
+    raw_uninit,
+    raw_draw,
+    raw_key,
+    raw_resize
+};
+
+void init_window(){
+
+    if (!backend) {
+        backend = &ncurses_backend;
+    }
+
+    backend->init();
+    alloc_grids();
+    build_tables();
+}
+
+void uninit_window(){
+    backend->uninit();
+    free(main_window.shown);
+    free(main_window.glyphs);
+    main_window.shown = NULL;
+    main_window.glyphs = NULL;
+    main_window.cells = 0;
+}
+
+int get_terminal_xy(uint32_t *x, uint32_t *y){
+
+    struct winsize ws;
+
+    if (-1 == ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) || !ws.ws_col ||
+        !ws.ws_row) {
+        return 1;
+    }
+
+    *x = ws.ws_col;
+    *y = ws.ws_row;
+
+    return 0;
+}
+
+int resize_window(void){
+
+    uint32_t x, y;
+
+    if (get_terminal_xy(&x, &y)) {
+        return 0;
+    }
+
+    if (x == main_window.max_x && y == main_window.max_y) {
+        return 0;
+    }
+
+    main_window.max_x = x;
+    main_window.max_y = y;
+
+    backend->resize();
+    alloc_grids();
+
+    return 1;
+}
+
+void set_raw_output(int raw){
+    backend = raw ? &raw_backend : &ncurses_backend;
+}
+
+/* nearest of the 0, 95, 135, 175, 215, 255 levels of the colour cube */
+static int cube_level(int v){
+    return v < 48 ? 0 : v < 115 ? 1 : (v - 35) / 40;
+}
+
+static int square(int v){
+    return v * v;
+}
+
+/* the cube or the grey ramp, whichever entry is closer */
+static void build_quantized(void){
+
+    static const int levels[6] = {0, 95, 135, 175, 215, 255};
+    int r, g, b;
+    int ri, gi, bi, grey, level;
+    int cube, ramp;
+
+    for (int i = 0; i < (1 << (3 * QUANT_BITS)); i++) {
+        r = (i >> (2 * QUANT_BITS)) << (8 - QUANT_BITS) | 4;
+        g = (i >> QUANT_BITS & ((1 << QUANT_BITS) - 1)) << (8 - QUANT_BITS) | 4;
+        b = (i & ((1 << QUANT_BITS) - 1)) << (8 - QUANT_BITS) | 4;
+
+        ri = cube_level(r);
+        gi = cube_level(g);
+        bi = cube_level(b);
+        cube = square(r - levels[ri]) + square(g - levels[gi]) +
+               square(b - levels[bi]);
+
+        /* 24 greys from 8 to 238 in steps of 10 */
+        grey = ((r + g + b) / 3 - 3) / 10;
+        grey = grey < 0 ? 0 : grey > 23 ? 23 : grey;
+        level = 8 + 10 * grey;
+        ramp = square(r - level) + square(g - level) + square(b - level);
+
+        quantized[i] = ramp < cube ? 232 + grey : 16 + 36 * ri + 6 * gi + bi;
+    }
+}
+
+int get_glyph_levels(void){
+    return braille ? 2 : intervals;
+}
+
+void set_braille_output(int on){
+
+    braille = on;
+    if (on) {
+        backend = &raw_backend;
+    }
+}
+
+void set_colour_output(enum colour_mode mode){
+
+    colour = mode;
+    if (COLOUR_OFF == mode) {
+        return;
+    }
+
+    backend = &raw_backend;
+
+    for (int i = 0; i < 256; i++) {
+        decimal_length[i] = snprintf(decimal[i], sizeof(decimal[i]), "%d",
+                                     i);
+    }
+
+    if (COLOUR_256 == mode) {
+        build_quantized();
+    }
+}
+
+void set_hud(const char *line){
+    hud = line;
+}
+
+int get_key(void){
+    return backend->key();
+}
+
 void get_window_xy(uint32_t *x, uint32_t *y){
     *x = main_window.max_x;
     *y = main_window.max_y;
 }
 
+void map_glyphs(
+    const uint8_t *frame,
+    char *glyphs,
+    size_t rows,
+    size_t width,
+    size_t line_width
+){
+
+    char *row;
+
+    if (!glyph_of[0]) {
+        build_tables();
+    }
+
+    /* mirrored like the picture in a mirror */
+    for (size_t y = 0; y < rows; y++) {
+        row = glyphs + y * width;
+        for (size_t x = 0; x < width; x++) {
+            row[x] = glyph_of[frame[y * line_width + line_width - 1 - x]];
+        }
+    }
+}
+
+int set_palette(const char *name){
+
+    char line[MAX_LEVELS + 2];
+    const char *glyphs = NULL;
+    FILE *fp;
+    size_t n;
+
+    for (size_t i = 0; i < sizeof(palettes) / sizeof(*palettes); i++) {
+        if (!strcmp(name, palettes[i].name)) {
+            glyphs = palettes[i].glyphs;
+        }
+    }
+
+    /* anything else is a file with the glyphs on its first line */
+    if (!glyphs) {
+        fp = fopen(name, "r");
+        if (!fp) {
+            fprintf(stderr, "Cannot open '%s': %d, %s\n",
+                 name, errno, strerror(errno));
+            return 1;
+        }
+        if (!fgets(line, sizeof(line), fp)) {
+            line[0] = '\0';
+        }
+        fclose(fp);
+        line[strcspn(line, "\r\n")] = '\0';
+        glyphs = line;
+    }
+
+    n = strlen(glyphs);
+    if (n < 2 || n > MAX_LEVELS) {
+        fprintf(stderr, "A palette takes 2 to %d glyphs\n", MAX_LEVELS);
+        return 1;
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (glyphs[i] < ' ' || glyphs[i] > '~') {
+            fprintf(stderr, "Palette glyphs have to be printable ASCII\n");
+            return 1;
+        }
+    }
+
+    memcpy(palette, glyphs, n + 1);
+    intervals = n;
+    build_tables();
+
+    return 0;
+}
+
+int set_gamma(double gamma){
+
+    if (gamma <= 0) {
+        return 1;
+    }
+
+    gamma_value = gamma;
+    build_tables();
+
+    return 0;
+}
+
+void adjust_tone(int contrast_steps, int brightness_steps){
+
+    contrast *= pow(CONTRAST_STEP, contrast_steps);
+    contrast = contrast < 1 / MAX_CONTRAST ? 1 / MAX_CONTRAST :
+               contrast > MAX_CONTRAST ? MAX_CONTRAST : contrast;
+
+    brightness += brightness_steps * BRIGHTNESS_STEP;
+    brightness = brightness < -1 ? -1 : brightness > 1 ? 1 : brightness;
+
+    build_tables();
+}
+
+void reset_tone(void){
+    contrast = 1.0;
+    brightness = 0.0;
+    build_tables();
+}
+
+void set_pretoned(int on){
+    pretoned = on;
+    build_tables();
+}
+
+void get_tone(uint8_t *curve){
+
+    unsigned int seq;
+    uint_least32_t word;
+
+    do {
+        /* a rewrite in progress is waited out */
+        while (1 & (seq = atomic_load_explicit(&tone_seq,
+                                               memory_order_acquire)));
+        for (int i = 0; i < 256 / 4; i++) {
+            word = atomic_load_explicit(&tone_words[i], memory_order_relaxed);
+            memcpy(curve + i * 4, &word, 4);
+        }
+        atomic_thread_fence(memory_order_acquire);
+    } while (seq != atomic_load_explicit(&tone_seq, memory_order_relaxed));
+}
+
+/* dots in U+2800 order: bits 0-2 down the left column, 3-5 down the right
+   one, 6 and 7 the bottom row */
+static void build_braille(void){
+    for (int i = 0; i < 256; i++) {
+        braille_utf8[i][0] = (char)0xe2;
+        braille_utf8[i][1] = (char)(0xa0 | i >> 6);
+        braille_utf8[i][2] = (char)(0x80 | (i & 0x3f));
+    }
+}
+
+char *map_braille(
+    const uint8_t *frame,
+    char *out,
+    size_t rows,
+    size_t width,
+    size_t line_width
+){
+
+    const uint8_t *r0, *r1, *r2, *r3;
+    size_t left, right;
+    unsigned int dots;
+
+    if (!braille_utf8[0][0]) {
+        build_braille();
+    }
+    if (!glyph_of[0]) {
+        build_tables();
+    }
+
+    for (size_t y = 0; y < rows; y++) {
+        r0 = frame + 4 * y * line_width;
+        r1 = r0 + line_width;
+        r2 = r1 + line_width;
+        r3 = r2 + line_width;
+
+        /* mirrored like map_glyphs(), a dot is lit from mid grey up */
+        for (size_t x = 0; x < width; x++) {
+            left = line_width - 1 - 2 * x;
+            right = left - 1;
+            dots = dot_of[r0[left]] | dot_of[r1[left]] << 1 |
+                   dot_of[r2[left]] << 2 | dot_of[r0[right]] << 3 |
+                   dot_of[r1[right]] << 4 | dot_of[r2[right]] << 5 |
+                   dot_of[r3[left]] << 6 | dot_of[r3[right]] << 7;
+            memcpy(out, braille_utf8[dots], 3);
+            out += 3;
+        }
+    }
+
+    return out;
+}
+
 void display_frame(uint8_t *frame, size_t n, size_t line_width){
-    clear();
-    for (int y = 0; y < n; y += line_width) {
-        for (int x = y + line_width - 1; x >= y; x--){
-            addch(palette[((frame[x])*intervals)/0x100u]);
+
+    size_t cells = braille ? line_width / 2 : line_width;
+    size_t width = cells < main_window.max_x ? cells : main_window.max_x;
+    size_t rows = n / line_width / (colour ? 2 : braille ? 4 : 1);
+    size_t length;
+    char *row;
+
+    if (rows > main_window.max_y) {
+        rows = main_window.max_y;
+    }
+
+    if (colour || braille) {
+        if (colour) {
+            draw_colour(frame, rows, width, line_width);
+        }
+        else {
+            draw_braille(frame, rows, width, line_width);
         }
+        main_window.valid = 1;
+        return;
     }
-    refresh();
+
+    /* a grid made before a resize comes out in another shape, diffing
+       against it by index would compare the wrong cells */
+    if (rows != main_window.shown_rows || width != main_window.shown_width) {
+        main_window.valid = 0;
+    }
+
+    map_glyphs(frame, main_window.glyphs, rows, width, line_width);
+
+    if (hud && rows) {
+        row = main_window.glyphs + (rows - 1) * width;
+        length = strlen(hud);
+        if (length > width) {
+            length = width;
+        }
+        memcpy(row, hud, length);
+        memset(row + length, ' ', width - length);
+    }
+
+    backend->draw(rows, width);
+
+    /* the new grid becomes the shown one */
+    row = main_window.shown;
+    main_window.shown = main_window.glyphs;
+    main_window.glyphs = row;
+    main_window.valid = 1;
+    main_window.shown_rows = rows;
+    main_window.shown_width = width;
 }
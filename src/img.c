@@ -1,210 +1,904 @@
 #include <pthread.h>
 #include "include/img.h"
+#include "include/pool.h"
+#include "include/luma.h"
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include "include/fixed_point.h"
 #include <turbojpeg.h>
+#include <jpeglib.h>
+#include <setjmp.h>
 #include <errno.h>
 #include <string.h>
+#include <stdatomic.h>
+#include <sched.h>
 
-/* don't use this is functions that start threads as it can change at any time
-   and that could break joining threads together
-*/
-static volatile unsigned int n_threads = 1;
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 /* slice image into n horizontal stripes to re-color */
 struct t_rgb_to_grey_info {
     image_t *src;
     image_t *dst;
-    int     y_start;
-    int     height;
 };
 
-static void *t_rgb_to_grey(void *arg){
+static void t_rgb_to_grey(void *arg, int index, int count){
     /* assume that the sizes match and don't check */
     struct t_rgb_to_grey_info *args = (struct t_rgb_to_grey_info*)arg;
-    uint8_t *s;
+    int y_start, height;
 
-    for (int y = args->y_start; y < args->y_start + args->height; y++) {
-        for (int x = 0; x < args->dst->width; x++) {
-            s = PIXEL_AT(args->src, x, y);
-            /* convert by average */
-            *(args->dst->image + args->dst->width*y + x) = (s[0]+s[1]+s[2])/3;
-        }
-    }
+    pool_stripe(args->dst->height, index, count, &y_start, &height);
 
-    return NULL;
+    for (int y = y_start; y < y_start + height; y++) {
+        rgb_to_luma_row(
+            PIXEL_AT(args->src, 0, y),
+            PIXEL_AT(args->dst, 0, y),
+            args->dst->width
+        );
+    }
 }
 
 int rgb_to_grey(image_t *src, image_t *dst){
 
-    pthread_t *tid;
-    struct t_rgb_to_grey_info *targs;
-    int px_per_thread = 0;
-    volatile unsigned int local_n_threads = n_threads;
+    struct t_rgb_to_grey_info targs;
 
     if (src->height != dst->height || src->width  != dst->width) {
         fprintf(stderr, "rgb_to_grey: sizes don't match\n");
         return 1;
     }
 
+    if (src->depth != 3) {
+        fprintf(stderr, "rgb_to_grey: src has wrong depth\n");
+        return 1;
+    }
+
     if (dst->depth != 1) {
         fprintf(stderr, "rgb_to_grey: dst has wrong depth\n");
         return 1;
     }
 
-    tid = (pthread_t*)malloc(sizeof(pthread_t) * local_n_threads);
-    targs = (struct t_rgb_to_grey_info*)malloc(
-        sizeof(struct t_rgb_to_grey_info) * local_n_threads);
+    targs.src = src;
+    targs.dst = dst;
 
-    px_per_thread = dst->height / local_n_threads;
+    pool_run(t_rgb_to_grey, &targs);
 
-    /* create threads */
-    for (int i = 0; i < local_n_threads; i++) {
-        targs[i].src = src;
-        targs[i].dst = dst;
-        targs[i].height = px_per_thread;
-        targs[i].y_start = px_per_thread * i;
+    return 0;
 
-        if (i + 1 == local_n_threads) {
-            targs[i].height += dst->height % local_n_threads;
-        }
+}
 
-        pthread_create(tid + i, NULL, t_rgb_to_grey, (void*)(targs + i));
+/* the downscaling kernels work on tiles of this many destination rows, picked
+   up by whichever worker is free */
+#define TILE_ROWS 8
+
+/* height / width of a destination pixel in fixed point, terminal cells are
+   about twice as tall as they are wide, 0 stretches the image instead */
+static int pixel_aspect = INT_TO_FIXED(2);
+
+/* nearest source coordinate for destination coordinate d, ratio is the
+   source / destination size in fixed point */
+static inline int nearest_source(int d, int ratio){
+
+    int P = MULTIPLY_FIXED(INT_TO_FIXED(d), ratio);
+    int c = CEIL(P);
+    int f = FLOOR(P);
+
+    if(c - P < -1 * (f - P)){
+        return FIXED_TO_INT(c);
     }
 
-    /* join all children */
-    for (int i = 0; i < local_n_threads; i++) {
-        pthread_join(tid[i], NULL);
+    return FIXED_TO_INT(f);
+}
+
+/* centred part of the source that keeps its proportions once drawn with
+   pixel_aspect shaped pixels, the rest is cropped off */
+static void crop_region(
+    int src_width,
+    int src_height,
+    int dst_width,
+    int dst_height,
+    int *x,
+    int *y,
+    int *width,
+    int *height
+){
+
+    /* destination height in square pixels, fixed point */
+    int64_t dst_square = (int64_t)dst_height * pixel_aspect;
+
+    *x = 0;
+    *y = 0;
+    *width = src_width;
+    *height = src_height;
+
+    if (!pixel_aspect) {
+        return;
     }
 
-    free(tid);
-    free(targs);
+    if (src_width * dst_square >
+        ((int64_t)dst_width * src_height << SHIFT_COUNT)) {
+        /* source is wider than the terminal, crop the sides */
+        *width = ((int64_t)src_height * dst_width << SHIFT_COUNT) / dst_square;
+        *width = *width ? *width : 1;
+        *x = (src_width - *width) / 2;
+    }
+    else {
+        *height = src_width * dst_square / ((int64_t)dst_width << SHIFT_COUNT);
+        *height = *height ? *height : 1;
+        *y = (src_height - *height) / 2;
+    }
+}
 
-    return 0;
+/* source sample positions for every destination column and row, they only
+   depend on the geometry so they're rebuilt when it changes, not per frame */
+struct resize_map {
+    int src_width;
+    int src_height;
+    int src_depth;
+    int dst_width;
+    int dst_height;
+    int aspect;
+
+    int *x_offset;  /* byte offset of the sample inside a source row */
+    int *y_index;   /* source row */
+    int x_capacity;
+    int y_capacity;
+};
+
+/* every thread resizing frames has tables of its own, they depend on the
+   sizes it works with */
+static _Thread_local struct resize_map resize_map;
 
+static int build_resize_map(struct resize_map *map, image_t *src, image_t *dst){
+
+    int x0, y0, width, height;
+    int ratio;
+    int i, v;
+
+    if (map->src_width == src->width && map->src_height == src->height &&
+        map->src_depth == src->depth && map->dst_width == dst->width &&
+        map->dst_height == dst->height && map->aspect == pixel_aspect) {
+        return 0;
+    }
+
+    /* the tables follow the terminal, so they get some headroom too */
+    if (map->x_capacity < dst->width) {
+        free(map->x_offset);
+        map->x_capacity = WITH_HEADROOM(dst->width);
+        map->x_offset = (int*)malloc(sizeof(int) * map->x_capacity);
+    }
+
+    if (map->y_capacity < dst->height) {
+        free(map->y_index);
+        map->y_capacity = WITH_HEADROOM(dst->height);
+        map->y_index = (int*)malloc(sizeof(int) * map->y_capacity);
+    }
+
+    if (!map->x_offset || !map->y_index) {
+        fprintf(stderr, "resize: out of memory\n");
+        map->x_capacity = map->x_offset ? map->x_capacity : 0;
+        map->y_capacity = map->y_index ? map->y_capacity : 0;
+        map->src_width = 0;
+        return 1;
+    }
+
+    crop_region(src->width, src->height, dst->width, dst->height,
+                &x0, &y0, &width, &height);
+
+    ratio = INT_TO_FIXED(width) / dst->width;
+    for (i = 0; i < dst->width; i++) {
+        v = nearest_source(i, ratio);
+        v = v < width ? v : width - 1;
+        map->x_offset[i] = (x0 + v) * src->depth;
+    }
+
+    ratio = INT_TO_FIXED(height) / dst->height;
+    for (i = 0; i < dst->height; i++) {
+        v = nearest_source(i, ratio);
+        v = v < height ? v : height - 1;
+        map->y_index[i] = y0 + v;
+    }
+
+    map->src_width = src->width;
+    map->src_height = src->height;
+    map->src_depth = src->depth;
+    map->dst_width = dst->width;
+    map->dst_height = dst->height;
+    map->aspect = pixel_aspect;
+
+    return 0;
 }
 
 struct t_resize_image_info {
-    image_t *src;
-    image_t *dst;
-    int     y_start;
-    int     height;
+    image_t             *src;
+    image_t             *dst;
+    struct resize_map   *map;
+    enum colour_layout  layout;     /* resize_to_rgb() only */
 };
 
-void *t_resize_image(void *arg){
+static void t_resize_image(void *arg, int tile){
     struct t_resize_image_info *args = (struct t_resize_image_info*)arg;
 
-    int x = 0;
-    int y = 0;
+    const int *x_offset = args->map->x_offset;
+    const int *y_index = args->map->y_index;
+    int width = args->dst->width;
+
+    uint8_t *s;
+    uint8_t *d;
+
+    int y_start = tile * TILE_ROWS;
+    int y_end = y_start + TILE_ROWS;
+
+    if (y_end > args->dst->height) {
+        y_end = args->dst->height;
+    }
+
+    for (int y = y_start; y < y_end; y++) {
+        d = PIXEL_AT(args->dst, 0, y);
+
+        /* upscaled rows repeat, copy the one already done */
+        if (y > y_start && y_index[y] == y_index[y - 1]) {
+            memcpy(d, d - args->dst->stride, width);
+            continue;
+        }
+
+        s = args->src->image + args->src->stride * y_index[y];
+        for (int x = 0; x < width; x++) {
+            d[x] = s[x_offset[x]];
+        }
+    }
+
+}
+
+int resize_image(image_t* src, image_t* dst){
 
-    int x_ratio = INT_TO_FIXED(args->src->width) / args->dst->width;
-    int y_ratio = INT_TO_FIXED(args->src->height) / args->dst->height;
+    /* use nearest neighbour sampling for speed */
+    struct t_resize_image_info targs;
+
+    if (build_resize_map(&resize_map, src, dst)) {
+        return 1;
+    }
+
+    targs.src = src;
+    targs.dst = dst;
+    targs.map = &resize_map;
 
-    int Px = 0;
-    int Py = 0;
+    pool_run_tiles(
+        t_resize_image,
+        &targs,
+        (dst->height + TILE_ROWS - 1) / TILE_ROWS
+    );
 
-    int y1 = 0;
-    int y2 = 0;
-    int x1 = 0;
-    int x2 = 0;
+    return 0;
+
+}
+
+/* fused colour conversion and downscale, only the source pixels the
+   destination samples are ever read and converted, so no full size grey
+   image is produced */
+static void t_resize_rgb_to_grey(void *arg, int tile){
+    struct t_resize_image_info *args = (struct t_resize_image_info*)arg;
 
-    int new_x = 0;
-    int new_y = 0;
+    const int *x_offset = args->map->x_offset;
+    const int *y_index = args->map->y_index;
+    int width = args->dst->width;
 
-    for (y = args->y_start; y < args->y_start + args->height; y++) {
-        for (x = 0; x < args->dst->width; x++) {
-            Px = MULTIPLY_FIXED(INT_TO_FIXED(x), x_ratio);
-            Py = MULTIPLY_FIXED(INT_TO_FIXED(y), y_ratio);
-            y1 = CEIL(Py);
-            y2 = FLOOR(Py);
-            x1 = CEIL(Px);
-            x2 = FLOOR(Px);
+    uint8_t *s;
+    uint8_t *d;
+    uint8_t *p;
+
+    int y_start = tile * TILE_ROWS;
+    int y_end = y_start + TILE_ROWS;
+
+    if (y_end > args->dst->height) {
+        y_end = args->dst->height;
+    }
+
+    for (int y = y_start; y < y_end; y++) {
+        d = PIXEL_AT(args->dst, 0, y);
+
+        if (y > y_start && y_index[y] == y_index[y - 1]) {
+            memcpy(d, d - args->dst->stride, width);
+            continue;
+        }
+
+        s = args->src->image + args->src->stride * y_index[y];
+        for (int x = 0; x < width; x++) {
+            p = s + x_offset[x];
+            d[x] = LUMA(p[0], p[1], p[2]);
+        }
+    }
 
-            if(x1 - Px < -1 * (x2 - Px)){
-                new_x = FIXED_TO_INT(x1);
+}
+
+int resize_rgb_to_grey(image_t *src, image_t *dst){
+
+    struct t_resize_image_info targs;
+
+    if (src->depth != 3) {
+        fprintf(stderr, "resize_rgb_to_grey: src has wrong depth\n");
+        return 1;
+    }
+
+    if (dst->depth != 1) {
+        fprintf(stderr, "resize_rgb_to_grey: dst has wrong depth\n");
+        return 1;
+    }
+
+    if (build_resize_map(&resize_map, src, dst)) {
+        return 1;
+    }
+
+    targs.src = src;
+    targs.dst = dst;
+    targs.map = &resize_map;
+
+    pool_run_tiles(
+        t_resize_rgb_to_grey,
+        &targs,
+        (dst->height + TILE_ROWS - 1) / TILE_ROWS
+    );
+
+    return 0;
+
+}
+
+/* BT.601 studio swing YUV to RGB in 8 bit fixed point */
+static inline uint8_t clamp_byte(int v){
+    return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+static inline void yuv_to_rgb(int y, int u, int v, uint8_t *d){
+
+    int c = 298 * (y - 16) + 128;
+
+    u -= 128;
+    v -= 128;
+    d[0] = clamp_byte((c + 409 * v) >> 8);
+    d[1] = clamp_byte((c - 100 * u - 208 * v) >> 8);
+    d[2] = clamp_byte((c + 516 * u) >> 8);
+}
+
+/* like t_resize_rgb_to_grey, only the sampled pixels are converted, here to
+   RGB for the colour grids */
+static void t_resize_to_rgb(void *arg, int tile){
+    struct t_resize_image_info *args = (struct t_resize_image_info*)arg;
+
+    const int *x_offset = args->map->x_offset;
+    const int *y_index = args->map->y_index;
+    int width = args->dst->width;
+
+    uint8_t *s;
+    uint8_t *d;
+    uint8_t *p;
+
+    int y_start = tile * TILE_ROWS;
+    int y_end = y_start + TILE_ROWS;
+
+    if (y_end > args->dst->height) {
+        y_end = args->dst->height;
+    }
+
+    for (int y = y_start; y < y_end; y++) {
+        d = PIXEL_AT(args->dst, 0, y);
+
+        if (y > y_start && y_index[y] == y_index[y - 1]) {
+            memcpy(d, d - args->dst->stride, width * 3);
+            continue;
+        }
+
+        s = args->src->image + args->src->stride * y_index[y];
+        switch (args->layout) {
+        case LAYOUT_RGB:
+            for (int x = 0; x < width; x++, d += 3) {
+                p = s + x_offset[x];
+                d[0] = p[0];
+                d[1] = p[1];
+                d[2] = p[2];
             }
-            else{
-                new_x = FIXED_TO_INT(x2);
+            break;
+        case LAYOUT_YUYV:
+            /* Y0 U Y1 V, the pair starts on a multiple of 4 */
+            for (int x = 0; x < width; x++, d += 3) {
+                p = s + (x_offset[x] & ~3);
+                yuv_to_rgb(s[x_offset[x]], p[1], p[3], d);
             }
-
-            if(y1 - Py < -1 * (y2 - Py)){
-                new_y = FIXED_TO_INT(y1);
+            break;
+        case LAYOUT_UYVY:
+            /* U Y0 V Y1 seen from Y0 */
+            for (int x = 0; x < width; x++, d += 3) {
+                p = s + (x_offset[x] & ~3);
+                yuv_to_rgb(s[x_offset[x]], p[-1], p[1], d);
+            }
+            break;
+        default:
+            for (int x = 0; x < width; x++, d += 3) {
+                d[0] = d[1] = d[2] = s[x_offset[x]];
             }
-            else{
-                new_y = FIXED_TO_INT(y2);
+            break;
+        }
+    }
+
+}
+
+int resize_to_rgb(image_t *src, enum colour_layout layout, image_t *dst){
+
+    struct t_resize_image_info targs;
+
+    if (dst->depth != 3) {
+        fprintf(stderr, "resize_to_rgb: dst has wrong depth\n");
+        return 1;
+    }
+
+    if (build_resize_map(&resize_map, src, dst)) {
+        return 1;
+    }
+
+    targs.src = src;
+    targs.dst = dst;
+    targs.map = &resize_map;
+    targs.layout = layout;
+
+    pool_run_tiles(
+        t_resize_to_rgb,
+        &targs,
+        (dst->height + TILE_ROWS - 1) / TILE_ROWS
+    );
+
+    return 0;
+
+}
+
+void set_pixel_aspect(int aspect){
+    pixel_aspect = aspect;
+}
+
+/* error diffusion state, per thread like the resize tables */
+struct dither_state {
+    int16_t     *error;     /* carried down into every row, one per pixel */
+    atomic_int  *done;      /* columns finished in every row */
+    size_t      capacity;   /* pixels */
+    int         rows;       /* room in done */
+};
+
+static _Thread_local struct dither_state dither_state;
+
+void uninit_resize(void){
+    free(resize_map.x_offset);
+    free(resize_map.y_index);
+    memset(&resize_map, 0, sizeof(resize_map));
+    free(dither_state.error);
+    free(dither_state.done);
+    memset(&dither_state, 0, sizeof(dither_state));
+}
+
+/* motion is looked for in blocks of this many pixels square, a small thing
+   moving changes its block a lot but the whole image very little */
+#define MOTION_BLOCK 8
+
+int image_changed(const image_t *a, const image_t *b, int threshold){
+
+    int x0, y0, x, y;
+    int w, h;
+    int limit;
+    int sad;
+    const uint8_t *pa, *pb;
+
+    for (y0 = 0; y0 < a->height; y0 += MOTION_BLOCK) {
+        h = a->height - y0 < MOTION_BLOCK ? a->height - y0 : MOTION_BLOCK;
+
+        for (x0 = 0; x0 < a->width; x0 += MOTION_BLOCK) {
+            w = a->width - x0 < MOTION_BLOCK ? a->width - x0 : MOTION_BLOCK;
+            limit = threshold * w * h * a->depth;
+            sad = 0;
+
+            for (y = y0; y < y0 + h; y++) {
+                pa = PIXEL_AT(a, x0, y);
+                pb = PIXEL_AT(b, x0, y);
+                for (x = 0; x < w * a->depth; x++) {
+                    sad += abs(pa[x] - pb[x]);
+                }
             }
 
-            *PIXEL_AT(args->dst, x, y) = *PIXEL_AT(args->src, new_x, new_y);
+            if (sad > limit) {
+                return 1;
+            }
         }
     }
 
-    return NULL;
+    return 0;
+}
+
+/* 4x4 Bayer matrix */
+static const uint8_t bayer[4][4] = {
+    {  0,  8,  2, 10 },
+    { 12,  4, 14,  6 },
+    {  3, 11,  1,  9 },
+    { 15,  7, 13,  5 },
+};
+
+struct t_dither_info {
+    image_t             *img;
+    int                 levels;
+    const uint8_t       *tone;
+    struct dither_state *state;
+    int                 nominal[128];   /* grey every bin stands for */
+    uint8_t             middle[128];    /* a value in the middle of it */
+};
+
+/* row[x] + up[x & 3] - down[x & 3], saturating on unsigned bytes, the
+   offset pattern repeats every 4 bytes so a 16 byte vector holds 4 of it */
+static void add_offsets(uint8_t *row, int n, const uint8_t up[4],
+                        const uint8_t down[4]){
+
+    int x = 0;
+    uint32_t u, d;
+
+    memcpy(&u, up, 4);
+    memcpy(&d, down, 4);
+
+#if defined(__SSE2__)
+    __m128i vu = _mm_set1_epi32((int)u);
+    __m128i vd = _mm_set1_epi32((int)d);
+    __m128i v;
+
+    for (; x + 16 <= n; x += 16) {
+        v = _mm_loadu_si128((const __m128i*)(row + x));
+        v = _mm_subs_epu8(_mm_adds_epu8(v, vu), vd);
+        _mm_storeu_si128((__m128i*)(row + x), v);
+    }
+#elif defined(__ARM_NEON)
+    uint8x16_t vu = vreinterpretq_u8_u32(vdupq_n_u32(u));
+    uint8x16_t vd = vreinterpretq_u8_u32(vdupq_n_u32(d));
+
+    for (; x + 16 <= n; x += 16) {
+        vst1q_u8(row + x, vqsubq_u8(vqaddq_u8(vld1q_u8(row + x), vu), vd));
+    }
+#endif
 
+    for (int v; x < n; x++) {
+        v = row[x] + up[x & 3] - down[x & 3];
+        row[x] = v < 0 ? 0 : v > 255 ? 255 : v;
+    }
 }
 
-int resize_image(image_t* src, image_t* dst){
+/* every pixel is put through the tone curve, then nudged by up to half a
+   quantizer step, the glyph mapping after it rounds the matrix pattern in */
+static void t_dither_ordered(void *arg, int tile){
+    struct t_dither_info *args = (struct t_dither_info*)arg;
 
-    /* use nearest neighbour sampling for speed */
-    pthread_t *tid;
-    struct t_resize_image_info *targs;
-    int px_per_thread = 0;
-    volatile unsigned int local_n_threads = n_threads;
-    int i;
-
-    tid = (pthread_t*)malloc(sizeof(pthread_t) * local_n_threads);
-    targs = (struct t_resize_image_info*)malloc(
-        sizeof(struct t_resize_image_info) * local_n_threads);
-
-    px_per_thread = dst->height / local_n_threads;
-
-    /* create threads */
-    for (i = 0; i < local_n_threads; i++) {
-        targs[i].src = src;
-        targs[i].dst = dst;
-        targs[i].height = px_per_thread;
-        targs[i].y_start = px_per_thread * i;
-
-        if (i + 1 == local_n_threads) {
-            targs[i].height += dst->height % local_n_threads;
+    const uint8_t *tone = args->tone;
+    int step = 256 / args->levels;
+    int offset;
+    uint8_t up[4], down[4];
+    uint8_t *row;
+
+    int y_start = tile * TILE_ROWS;
+    int y_end = y_start + TILE_ROWS;
+
+    if (y_end > args->img->height) {
+        y_end = args->img->height;
+    }
+
+    for (int y = y_start; y < y_end; y++) {
+        for (int i = 0; i < 4; i++) {
+            offset = (2 * bayer[y & 3][i] + 1 - 16) * step / 32;
+            up[i] = offset > 0 ? offset : 0;
+            down[i] = offset < 0 ? -offset : 0;
         }
 
-        pthread_create(tid + i, NULL, t_resize_image, (void*)(targs + i));
+        row = PIXEL_AT(args->img, 0, y);
+        for (int x = 0; x < args->img->width; x++) {
+            row[x] = tone[row[x]];
+        }
+        add_offsets(row, args->img->width, up, down);
     }
-    for (i = 0; i < local_n_threads; i++) {
-        pthread_join(tid[i], NULL);
+}
+
+/* columns a row does between two looks at the row above */
+#define DITHER_CHUNK 32
+
+/* Floyd-Steinberg, rows are dealt out to the workers in turn and a row only
+   runs DITHER_CHUNK columns at a time, as far as the row above has got past
+   them, so the rows move down the image as a slanted wavefront */
+static void t_dither_diffusion(void *arg, int index, int count){
+    struct t_dither_info *args = (struct t_dither_info*)arg;
+
+    image_t *img = args->img;
+    int levels = args->levels;
+    int width = img->width;
+    int16_t *error = args->state->error;
+    atomic_int *done = args->state->done;
+    int16_t *in, *out;
+    uint8_t *row;
+    int x, x1, need;
+    int carry, want, i, e;
+
+    for (int y = index; y < img->height; y += count) {
+        row = PIXEL_AT(img, 0, y);
+        in = error + (size_t)y * width;
+        out = y + 1 < img->height ? in + width : NULL;
+        if (out) {
+            memset(out, 0, sizeof(*out) * width);
+        }
+        carry = 0;
+
+        for (x = 0; x < width; x = x1) {
+            x1 = x + DITHER_CHUNK < width ? x + DITHER_CHUNK : width;
+
+            /* the row above is the last to add to in[x1 - 1], once it's
+               past x1 */
+            need = x1 + 1 < width ? x1 + 1 : width;
+            while (y && atomic_load_explicit(&done[y - 1],
+                                             memory_order_acquire) < need) {
+                sched_yield();
+            }
+
+            for (int c = x; c < x1; c++) {
+                want = args->tone[row[c]] + in[c] + carry;
+                want = want < 0 ? 0 : want > 255 ? 255 : want;
+
+                /* the bin the glyph mapping puts it in */
+                i = want * levels >> 8;
+                e = want - args->nominal[i];
+                row[c] = args->middle[i];
+
+                carry = e * 7 / 16;
+                if (out) {
+                    if (c) {
+                        out[c - 1] += e * 3 / 16;
+                    }
+                    out[c] += e * 5 / 16;
+                    if (c + 1 < width) {
+                        out[c + 1] += e / 16;
+                    }
+                }
+            }
+
+            atomic_store_explicit(&done[y], x1, memory_order_release);
+        }
     }
+}
 
-    free(tid);
-    free(targs);
+int dither_image(image_t *img, int levels, const uint8_t *tone,
+                 enum dither_mode mode){
+
+    struct dither_state *state = &dither_state;
+    struct t_dither_info targs;
+    size_t pixels = (size_t)img->width * img->height;
+
+    if (DITHER_NONE == mode || levels < 2 || levels > 128) {
+        return 0;
+    }
+
+    if (img->depth != 1) {
+        fprintf(stderr, "dither_image: img has wrong depth\n");
+        return 1;
+    }
+
+    targs.img = img;
+    targs.levels = levels;
+    targs.tone = tone;
+    targs.state = state;
+
+    if (DITHER_ORDERED == mode) {
+        pool_run_tiles(
+            t_dither_ordered,
+            &targs,
+            (img->height + TILE_ROWS - 1) / TILE_ROWS
+        );
+        return 0;
+    }
+
+    for (int i = 0; i < levels; i++) {
+        targs.nominal[i] = i * 255 / (levels - 1);
+        targs.middle[i] = (i * 256 + 128) / levels;
+    }
+
+    if (state->capacity < pixels || state->rows < img->height) {
+        free(state->error);
+        free(state->done);
+        state->capacity = WITH_HEADROOM(pixels);
+        state->rows = WITH_HEADROOM(img->height);
+        state->error = (int16_t*)malloc(sizeof(int16_t) * state->capacity);
+        state->done = (atomic_int*)malloc(sizeof(atomic_int) * state->rows);
+        if (!state->error || !state->done) {
+            fprintf(stderr, "dither_image: out of memory\n");
+            free(state->error);
+            free(state->done);
+            memset(state, 0, sizeof(*state));
+            return 1;
+        }
+    }
+
+    memset(state->error, 0, sizeof(int16_t) * img->width);
+    for (int y = 0; y < img->height; y++) {
+        atomic_init(&state->done[y], 0);
+    }
+
+    pool_run(t_dither_diffusion, &targs);
 
     return 0;
+}
+
+/* TurboJPEG's API can't crop, cropped decodes go through libjpeg, with the
+   state kept between frames like the handle */
+struct jpeg_region {
+    struct jpeg_decompress_struct   cinfo;
+    struct jpeg_error_mgr           err;
+    jmp_buf                         fail;
+};
 
+static void region_error_exit(j_common_ptr cinfo){
+
+    struct jpeg_region *region = (struct jpeg_region*)cinfo->client_data;
+    char message[JMSG_LENGTH_MAX];
+
+    cinfo->err->format_message(cinfo, message);
+    fprintf(stderr, "jpeg error: %s\n", message);
+
+    longjmp(region->fail, 1);
 }
 
-void decompress_jpeg(
-    uint8_t *compressed_image,
-    unsigned int jpeg_size,
-    image_t *dst
-){
+/* warnings about slightly broken frames would only scribble on the picture */
+static void region_output_message(j_common_ptr cinfo){
+}
 
-    int jpegSubsamp, width = 1000, height = 1000;
-    int ret = 0;
-    uint8_t buffer[1000*1000*3];
+static struct jpeg_region *get_region(jpeg_decoder_t *dec){
+
+    struct jpeg_region *region = (struct jpeg_region*)dec->region;
+
+    if (region) {
+        return region;
+    }
+
+    region = (struct jpeg_region*)malloc(sizeof(*region));
+    if (!region) {
+        fprintf(stderr, "jpeg error: out of memory\n");
+        return NULL;
+    }
+
+    region->cinfo.err = jpeg_std_error(&region->err);
+    region->err.error_exit = region_error_exit;
+    region->err.output_message = region_output_message;
+    region->cinfo.client_data = region;
+    jpeg_create_decompress(&region->cinfo);
 
-    tjhandle jpeg_decompressor = tjInitDecompress();
+    dec->region = region;
 
-    if (NULL == jpeg_decompressor) {
+    return region;
+}
+
+static void free_region(jpeg_decoder_t *dec){
+
+    struct jpeg_region *region = (struct jpeg_region*)dec->region;
+
+    if (region) {
+        jpeg_destroy_decompress(&region->cinfo);
+        free(region);
+        dec->region = NULL;
+    }
+}
+
+int init_jpeg_decoder(jpeg_decoder_t *dec, int width, int height, int depth){
+
+    if (depth != 1 && depth != 3) {
+        fprintf(stderr, "jpeg error: unsupported output depth %d\n", depth);
+        return 1;
+    }
+
+    dec->handle = tjInitDecompress();
+
+    if (NULL == dec->handle) {
         fprintf(
             stderr,
             "jpeg error: failed to create decompressor\n"
         );
-        exit(EXIT_FAILURE);
+        return 1;
+    }
+
+    /* sized for a full scale decode of the negotiated format, scaled
+       decodes only ever need less */
+    dec->size = (size_t)width * height * depth;
+    dec->buffer = (uint8_t*)malloc(dec->size);
+
+    if (NULL == dec->buffer) {
+        fprintf(stderr, "jpeg error: out of memory\n");
+        tjDestroy(dec->handle);
+        dec->handle = NULL;
+        return 1;
     }
 
+    dec->depth = depth;
+    dec->target_width = 0;
+    dec->target_height = 0;
+    dec->region = NULL;
+
+    return 0;
+}
+
+void uninit_jpeg_decoder(jpeg_decoder_t *dec){
+
+    if (dec->handle) {
+        tjDestroy(dec->handle);
+    }
+    free(dec->buffer);
+    free_region(dec);
+
+    dec->handle = NULL;
+    dec->buffer = NULL;
+    dec->size = 0;
+}
+
+void set_jpeg_decoder_target(jpeg_decoder_t *dec, int width, int height){
+    dec->target_width = width;
+    dec->target_height = height;
+}
+
+/* pick the smallest DCT scaling factor that still gives at least the target
+   size, so the decoder skips the frequencies the resize would throw away */
+static tjscalingfactor pick_scaling_factor(
+    jpeg_decoder_t *dec,
+    int width,
+    int height
+){
+
+    static const tjscalingfactor candidates[] = {{1, 8}, {1, 4}, {1, 2}};
+    tjscalingfactor *supported;
+    int n_supported = 0;
+    tjscalingfactor one = {1, 1};
+
+    int x, y, w, h;
+
+    /* nothing to cover yet, decode at full size */
+    if (!dec->target_width || !dec->target_height) {
+        return one;
+    }
+
+    supported = tjGetScalingFactors(&n_supported);
+
+    for (int i = 0; i < sizeof(candidates)/sizeof(*candidates); i++) {
+
+        /* only the part left after the aspect crop has to cover the target */
+        crop_region(
+            TJSCALED(width, candidates[i]),
+            TJSCALED(height, candidates[i]),
+            dec->target_width,
+            dec->target_height,
+            &x, &y, &w, &h
+        );
+
+        if (w < dec->target_width || h < dec->target_height) {
+            continue;
+        }
+
+        for (int j = 0; j < n_supported; j++) {
+            if (supported[j].num == candidates[i].num &&
+                supported[j].denom == candidates[i].denom) {
+                return candidates[i];
+            }
+        }
+    }
+
+    return one;
+}
+
+int decompress_jpeg(
+    jpeg_decoder_t *dec,
+    uint8_t *compressed_image,
+    unsigned int jpeg_size,
+    image_t *dst
+){
+
+    int jpegSubsamp, width, height;
+    int ret = 0;
+    tjscalingfactor scale;
+
     ret = tjDecompressHeader2(
-        jpeg_decompressor,
+        dec->handle,
         compressed_image,
         jpeg_size,
         &width,
@@ -213,42 +907,181 @@ void decompress_jpeg(
     );
 
     if (-1 == ret) {
-        fprintf(stderr, "jpeg error: %s\n", tjGetErrorStr2(jpeg_decompressor));
-        exit(EXIT_FAILURE);
+        fprintf(stderr, "jpeg error: %s\n", tjGetErrorStr2(dec->handle));
+        return 1;
+    }
+
+    scale = pick_scaling_factor(dec, width, height);
+    width = TJSCALED(width, scale);
+    height = TJSCALED(height, scale);
+
+    if ((size_t)width * height * dec->depth > dec->size) {
+        fprintf(
+            stderr,
+            "jpeg error: %dx%d frame doesn't fit the decode buffer\n",
+            width,
+            height
+        );
+        return 1;
     }
 
     ret = tjDecompress2(
-        jpeg_decompressor,
+        dec->handle,
         compressed_image,
         jpeg_size,
-        buffer,
+        dec->buffer,
         width,
         0,
         height,
-        TJPF_RGB,
+        dec->depth == 1 ? TJPF_GRAY : TJPF_RGB,
         TJFLAG_FASTDCT
     );
 
     if (-1 == ret) {
-        fprintf(stderr, "jpeg error: %s\n", tjGetErrorStr2(jpeg_decompressor));
-        exit(EXIT_FAILURE);
+        fprintf(stderr, "jpeg error: %s\n", tjGetErrorStr2(dec->handle));
+        return 1;
     }
 
-    dst->image = (uint8_t*)malloc(width*height*3);
+    dst->image = dec->buffer;
     dst->height = height;
     dst->width = width;
-    dst->depth = 3;
+    dst->depth = dec->depth;
+    dst->stride = width * dec->depth;
+
+    return 0;
+}
+
+void roi_view(const image_t *src, const roi_t *roi, image_t *dst){
+
+    int x = (int64_t)roi->x * src->width / ROI_ONE;
+    int y = (int64_t)roi->y * src->height / ROI_ONE;
+    int width = (int64_t)roi->width * src->width / ROI_ONE;
+    int height = (int64_t)roi->height * src->height / ROI_ONE;
+
+    /* a packed YUV view has to start on a whole Y U Y V pair */
+    if (2 == src->depth) {
+        x &= ~1;
+    }
+
+    *dst = *src;
+    dst->width = width ? width : 1;
+    dst->height = height ? height : 1;
+    dst->image = PIXEL_AT(src, x, y);
+}
+
+/* the rows above the region are skipped without the IDCT, the columns left
+   and right of it, rounded out to whole iMCUs, aren't decoded at all and the
+   rows below are never touched */
+int decompress_jpeg_roi(
+    jpeg_decoder_t *dec,
+    uint8_t *compressed_image,
+    unsigned int jpeg_size,
+    const roi_t *roi,
+    image_t *dst
+){
+
+    struct jpeg_region *region;
+    struct jpeg_decompress_struct *cinfo;
+    tjscalingfactor scale;
+    JDIMENSION crop_x, crop_width;
+    JSAMPROW row;
+    int x, y, width, height;
+    int cx, cy, cw, ch;
+
+    if (0 == roi->x && 0 == roi->y &&
+        ROI_ONE == roi->width && ROI_ONE == roi->height) {
+        return decompress_jpeg(dec, compressed_image, jpeg_size, dst);
+    }
+
+    region = get_region(dec);
+    if (!region) {
+        return 1;
+    }
+    cinfo = &region->cinfo;
+
+    if (setjmp(region->fail)) {
+        jpeg_abort_decompress(cinfo);
+        return 1;
+    }
+
+    jpeg_mem_src(cinfo, compressed_image, jpeg_size);
+    jpeg_read_header(cinfo, TRUE);
+
+    x = (int64_t)roi->x * cinfo->image_width / ROI_ONE;
+    y = (int64_t)roi->y * cinfo->image_height / ROI_ONE;
+    width = (int64_t)roi->width * cinfo->image_width / ROI_ONE;
+    height = (int64_t)roi->height * cinfo->image_height / ROI_ONE;
+    width = width ? width : 1;
+    height = height ? height : 1;
+
+    /* the resize would crop the region to the display's shape anyway */
+    if (dec->target_width && dec->target_height) {
+        crop_region(width, height, dec->target_width, dec->target_height,
+                    &cx, &cy, &cw, &ch);
+        x += cx;
+        y += cy;
+        width = cw;
+        height = ch;
+    }
+
+    scale = pick_scaling_factor(dec, width, height);
+    cinfo->scale_num = scale.num;
+    cinfo->scale_denom = scale.denom;
+    cinfo->out_color_space = dec->depth == 1 ? JCS_GRAYSCALE : JCS_RGB;
+    cinfo->dct_method = JDCT_IFAST;
 
-    memcpy(dst->image, buffer, dst->height * dst->width * dst->depth);
+    jpeg_start_decompress(cinfo);
 
-    tjDestroy(jpeg_decompressor);
+    /* the region in scaled pixels */
+    x = (int64_t)x * scale.num / scale.denom;
+    y = (int64_t)y * scale.num / scale.denom;
+    width = TJSCALED(width, scale);
+    height = TJSCALED(height, scale);
+    width = x + width <= cinfo->output_width ? width : cinfo->output_width - x;
+    height = y + height <= cinfo->output_height ?
+             height : cinfo->output_height - y;
 
+    crop_x = x;
+    crop_width = width;
+    jpeg_crop_scanline(cinfo, &crop_x, &crop_width);
+
+    if ((size_t)crop_width * height * dec->depth > dec->size) {
+        fprintf(
+            stderr,
+            "jpeg error: %ux%d region doesn't fit the decode buffer\n",
+            crop_width,
+            height
+        );
+        jpeg_abort_decompress(cinfo);
+        return 1;
+    }
+
+    jpeg_skip_scanlines(cinfo, y);
+
+    while (cinfo->output_scanline < (JDIMENSION)(y + height)) {
+        row = dec->buffer +
+              (size_t)(cinfo->output_scanline - y) * crop_width * dec->depth;
+        jpeg_read_scanlines(cinfo, &row, 1);
+    }
+
+    jpeg_abort_decompress(cinfo);
+
+    /* the crop starts at an iMCU boundary, the view at the region */
+    dst->image = dec->buffer + (x - crop_x) * dec->depth;
+    dst->width = width;
+    dst->height = height;
+    dst->depth = dec->depth;
+    dst->stride = crop_width * dec->depth;
+
+    return 0;
 }
 
+/* safe to call between frames, the pool waits for a job in flight before it
+   swaps its workers */
 void set_thread_n(int n){
-    n_threads = n;
+    pool_resize(n);
 }
 
 int get_thread_n(void){
-    return n_threads;
+    return pool_size();
 }
@@ -7,6 +7,90 @@
 void init_window(void);
 void uninit_window(void);
 void get_window_xy(uint32_t *x, uint32_t *y);
+
+/* size of the terminal on stdout, works before init_window(), 1 when stdout
+ * isn't one
+ */
+int get_terminal_xy(uint32_t *x, uint32_t *y);
+
+/* pick up a new terminal size, 1 if it changed, the next frame is drawn
+ * whole
+ */
+int resize_window(void);
 void display_frame(uint8_t *frame, size_t n, size_t line_width);
 
+/* turn rows x width pixels of a grey frame into glyphs, no terminal needed */
+void map_glyphs(
+    const uint8_t *frame,
+    char *glyphs,
+    size_t rows,
+    size_t width,
+    size_t line_width
+);
+
+/* turn rows x width cells of 2x4 grey pixels each into UTF-8 braille
+ * patterns, 3 bytes a cell without line breaks, returns the end of out
+ */
+char *map_braille(
+    const uint8_t *frame,
+    char *out,
+    size_t rows,
+    size_t width,
+    size_t line_width
+);
+
+/* draw braille patterns, 2x4 pixels a cell, the frames given to
+ * display_frame() are then grey with twice the columns and four times the
+ * rows, implies the raw backend and has to be picked before init_window()
+ */
+void set_braille_output(int on);
+
+/* the glyphs to draw with, from sparse to dense: ascii, short, long, or a
+ * file with them on its first line, 1 when it's no good
+ */
+int set_palette(const char *name);
+
+/* the tone curve every level is put through, rebuilding the tables is all
+ * a change costs, above 1 gamma lightens the mid tones, 1 when out of range
+ */
+int set_gamma(double gamma);
+void adjust_tone(int contrast_steps, int brightness_steps);
+void reset_tone(void);
+
+/* a copy of the curve as a 256 entry table, for frames that get it applied
+ * before they come here, set_pretoned() then leaves it out of the glyph
+ * mapping, safe from any thread while a key changes the curve
+ */
+void get_tone(uint8_t *curve);
+void set_pretoned(int on);
+
+/* grey levels the glyph mapping tells apart, bins of 256 / levels */
+int get_glyph_levels(void);
+
+/* draw with raw escape sequences and one write() per frame instead of
+ * ncurses, has to be picked before init_window()
+ */
+void set_raw_output(int raw);
+
+enum colour_mode {
+    COLOUR_OFF,
+    COLOUR_256,     /* the xterm 256 colour palette */
+    COLOUR_TRUE,    /* 24 bit SGR colours */
+};
+
+/* draw in colour, two pixels a cell as half blocks with their own fore and
+ * background colours, the frames given to display_frame() are then RGB with
+ * twice the rows, implies the raw backend and has to be picked before
+ * init_window()
+ */
+void set_colour_output(enum colour_mode mode);
+
+/* text drawn over the last row of every frame, NULL hides it, the string
+ * has to stay around while it's shown
+ */
+void set_hud(const char *line);
+
+/* next key pressed or ERR, never blocks */
+int get_key(void);
+
 #endif
@@ -2,25 +2,106 @@
 #define IMG_H
 
 #include <stdint.h>
+#include <stddef.h>
 
 typedef struct{
     uint8_t *image;
     int width;
     int height;
     int depth;
+    int stride;     /* bytes between the starts of two rows */
 }image_t;
 
+/* persistent TurboJPEG state, the handle and the output buffer are kept
+ * between frames so decoding doesn't allocate
+ */
+typedef struct{
+    void    *handle;
+    uint8_t *buffer;
+    size_t  size;
+    int     depth;          /* 1 decodes straight to grey, 3 to RGB */
+    int     target_width;   /* smallest output still covering the display */
+    int     target_height;
+    void    *region;        /* libjpeg state for cropped decodes, on demand */
+}jpeg_decoder_t;
+
+/* part of a frame, in ROI_ONE-ths of its width and height */
+#define ROI_ONE             (1 << 16)
+
+typedef struct{
+    int x;
+    int y;
+    int width;
+    int height;
+}roi_t;
+
+/* capacity for a buffer that follows the terminal size, the extra quarter
+   lets small resizes reuse it */
+#define WITH_HEADROOM(n)    ((n) + (n) / 4)
+
 /* macro for calculating the image array address at the given place */
-#define PIXEL_AT(img, x, y)  (img->image + \
-                              img->width * img->depth * y +\
-                              img->depth * x)
+#define PIXEL_AT(img, x, y)  ((img)->image + \
+                              (img)->stride * (y) +\
+                              (img)->depth * (x))
+
 
+/* src cut down to the roi, no pixels are copied, the view keeps src's
+   stride */
+void roi_view(const image_t *src, const roi_t *roi, image_t *dst);
+
+/* 1 when some block of the two images, which have to be the same size and
+   depth, differs by more than threshold levels per sample on average */
+int image_changed(const image_t *a, const image_t *b, int threshold);
 
 int rgb_to_grey(image_t *src, image_t *dst);
 int resize_image(image_t* src, image_t* dst);
-void decompress_jpeg(
+int resize_rgb_to_grey(image_t *src, image_t *dst);
+
+/* how the colour of a source frame is stored */
+enum colour_layout {
+    LAYOUT_GREY,    /* Y only, a grey or the luma plane of a planar frame */
+    LAYOUT_RGB,     /* depth 3 */
+    LAYOUT_YUYV,    /* depth 2, starts at Y0 of a pair */
+    LAYOUT_UYVY,    /* depth 2, starts at Y0, one past the pair's U */
+};
+
+/* downscale to an RGB dst, converting only the pixels it samples */
+int resize_to_rgb(image_t *src, enum colour_layout layout, image_t *dst);
+void set_pixel_aspect(int aspect);
+
+enum dither_mode {
+    DITHER_NONE,
+    DITHER_ORDERED,     /* 4x4 Bayer matrix */
+    DITHER_DIFFUSION,   /* Floyd-Steinberg */
+};
+
+/* dither a grey image in place for a quantizer of levels equal bins, what
+   a pixel is mapped to is then (v * levels) >> 8, 2 to 128 levels, every
+   pixel is put through the 256 entry tone curve first */
+int dither_image(image_t *img, int levels, const uint8_t *tone,
+                 enum dither_mode mode);
+
+/* the resize and dither tables are per thread, this frees the calling
+   thread's */
+void uninit_resize(void);
+
+int init_jpeg_decoder(jpeg_decoder_t *dec, int width, int height, int depth);
+void uninit_jpeg_decoder(jpeg_decoder_t *dec);
+void set_jpeg_decoder_target(jpeg_decoder_t *dec, int width, int height);
+int decompress_jpeg(
+    jpeg_decoder_t *dec,
+    uint8_t *compressed_image,
+    unsigned int jpeg_size,
+    image_t *dst
+);
+
+/* decode only the roi of the frame, what of it the display's aspect crops
+   off included, a whole frame roi is a plain decompress_jpeg() */
+int decompress_jpeg_roi(
+    jpeg_decoder_t *dec,
     uint8_t *compressed_image,
     unsigned int jpeg_size,
+    const roi_t *roi,
     image_t *dst
 );
 
@@ -0,0 +1,34 @@
+#ifndef LUMA_H
+#define LUMA_H
+
+#include <stdint.h>
+
+/* BT.601 luma in 8 bit fixed point, the weights add up to 256 so white stays
+ * white, every kernel variant has to match this bit for bit
+ */
+#define LUMA_R 77u
+#define LUMA_G 150u
+#define LUMA_B 29u
+#define LUMA(r, g, b) ((LUMA_R * (r) + LUMA_G * (g) + LUMA_B * (b) + 128u) >> 8)
+
+/* converts n packed RGB24 pixels to n grey bytes */
+typedef void (*luma_row_t)(const uint8_t *rgb, uint8_t *grey, int n);
+
+struct luma_kernel {
+    const char  *name;
+    luma_row_t  row;
+    int         (*supported)(void);
+};
+
+/* every variant built into this binary, scalar reference first */
+extern const struct luma_kernel luma_kernels[];
+extern const int n_luma_kernels;
+
+/* fastest variant this CPU supports, picked by init_luma() */
+extern luma_row_t rgb_to_luma_row;
+
+void init_luma(void);
+int set_luma_kernel(const char *name);
+const char *get_luma_kernel(void);
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef POOL_H
+#define POOL_H
+
+/* long-lived worker pool used by the image kernels, the calling thread
+ * always takes part in the work as worker 0, and does all of it when the
+ * pool is already running a job for another thread
+ */
+
+/* job entry point, called once on every worker with its index and the total
+ * number of workers taking part in this run
+ */
+typedef void (*pool_job_t)(void *arg, int index, int count);
+
+/* tile entry point, called once for every tile by whichever worker grabs it */
+typedef void (*pool_tile_t)(void *arg, int tile);
+
+int pool_init(int n);
+void pool_uninit(void);
+int pool_resize(int n);
+int pool_size(void);
+void pool_run(pool_job_t job, void *arg);
+void pool_run_tiles(pool_tile_t job, void *arg, int n_tiles);
+
+/* split `total` rows into `count` stripes and return the one for `index` */
+void pool_stripe(int total, int index, int count, int *start, int *length);
+
+#endif
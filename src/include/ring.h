@@ -0,0 +1,31 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stdatomic.h>
+
+/* bounded single producer / single consumer queue of small integers (buffer
+ * or slot indices), push and pop are lock free, a full ring drops its oldest
+ * entry instead of blocking the producer
+ */
+struct ring {
+    atomic_uint     *slots;
+    unsigned int    mask;
+    atomic_ulong    head;       /* next slot to write, producer only */
+    atomic_ulong    tail;       /* next slot to read, moved by the consumer
+                                   and by the producer when it drops */
+    int             event_fd;   /* signalled on every push */
+};
+
+int ring_init(struct ring *ring, unsigned int capacity);
+void ring_uninit(struct ring *ring);
+
+/* returns 1 and the dropped entry in *dropped when the ring was full */
+int ring_push(struct ring *ring, unsigned int value, unsigned int *dropped);
+
+/* returns 0 when the ring is empty */
+int ring_pop(struct ring *ring, unsigned int *value);
+
+/* sleep until something was pushed or timeout_ms passed, 0 on timeout */
+int ring_wait(struct ring *ring, int timeout_ms);
+
+#endif
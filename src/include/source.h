@@ -0,0 +1,80 @@
+#ifndef SOURCE_H
+#define SOURCE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* a captured frame, the data belongs to the source until it's put back */
+struct frame {
+    uint8_t         *data;
+    size_t          size;
+    unsigned int    index;      /* source buffer, below n_buffers() */
+    uint64_t        timestamp;  /* capture time, CLOCK_MONOTONIC ns */
+};
+
+struct frame_format {
+    uint32_t    pixelformat;    /* V4L2 fourcc */
+    int         width;
+    int         height;
+    int         stride;         /* bytes per line, 0 for compressed data */
+};
+
+/* where frames come from, a live V4L2 device or a recorded stream */
+struct frame_source {
+    void (*open)(void);
+    void (*init)(void);
+    void (*start)(void);
+    void (*stop)(void);
+    void (*uninit)(void);
+    void (*close)(void);
+
+    /* readable when wait() would return at once, for poll() and friends */
+    int  (*fd)(void);
+    /* 1 once a frame may be ready, 0 on timeout, -1 when the stream ended */
+    int  (*wait)(int timeout_ms);
+    /* 0 when no frame is ready */
+    int  (*get)(struct frame *frame);
+    void (*put)(struct frame *frame);
+
+    void (*format)(struct frame_format *fmt);
+    unsigned int (*n_buffers)(void);
+
+    /* renegotiate the frame size and rate from the fit_* settings, 1 when
+       the stream was restarted in a new format, which takes back every
+       frame that wasn't put yet */
+    int  (*refit)(void);
+};
+
+extern const struct frame_source v4l2_source;
+extern const struct frame_source file_source;
+
+/* filled in from the command line before the source is opened */
+struct source_config {
+    const char      *device;
+    uint32_t        pixelformat;    /* 0 picks one automatically */
+    unsigned int    buffers;
+    const char      *record;        /* v4l2, also write the frames here */
+    const char      *replay;        /* file, the recorded stream */
+    int             fast;           /* file, ignore the recorded timing */
+    int             loop;           /* file, start over at the end */
+
+    /* v4l2, capture the smallest frame size covering a fit_width x
+       fit_height grid, no faster than a frame every min_interval_ns */
+    int             fit;
+    unsigned int    fit_width;
+    unsigned int    fit_height;
+    uint64_t        min_interval_ns;
+};
+
+extern struct source_config source_config;
+
+/* fourcc for a -f name like "yuyv", 0 when there's no such format */
+uint32_t source_pixelformat(const char *name);
+
+/* a recording is the raw frames back to back in `path` and an index of
+ * them in `path`.idx, the first line holds the fourcc, width, height and
+ * stride, then every frame gets its offset, size and timestamp in ns
+ */
+#define RECORDING_INDEX_SUFFIX ".idx"
+
+#endif
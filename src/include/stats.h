@@ -0,0 +1,59 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* performance counters, every thread adds to a block of its own so the hot
+ * path is a couple of plain stores, readers sum the blocks up
+ */
+
+enum stat_counter {
+    STAT_CAPTURED,      /* frames taken from the source */
+    STAT_RENDERED,      /* frames drawn */
+    STAT_DROPPED,       /* frames thrown away anywhere on the way */
+    STAT_IDLE,          /* frames not decoded or drawn, nothing moved */
+    N_STAT_COUNTERS
+};
+
+enum stat_stage {
+    STAT_DECODE,        /* decode or wrap the captured frame */
+    STAT_RESIZE,        /* downscale, grey conversion, dither */
+    STAT_DRAW,          /* glyph mapping and terminal output */
+    N_STAT_STAGES
+};
+
+struct stats_snapshot {
+    uint64_t    counters[N_STAT_COUNTERS];
+    uint64_t    stage_ns[N_STAT_STAGES];
+    uint64_t    stage_calls[N_STAT_STAGES];
+};
+
+/* CLOCK_MONOTONIC in ns */
+uint64_t stats_now(void);
+
+void stats_count(enum stat_counter counter, uint64_t n);
+
+/* adds the time since start, a stats_now() stamp, to the stage */
+void stats_time(enum stat_stage stage, uint64_t start);
+
+/* a thread about to exit hands its block on to the next one started */
+void stats_release(void);
+
+/* totals of every thread so far */
+void stats_read(struct stats_snapshot *snapshot);
+
+/* also write the rates to this file or FIFO, one line per period */
+int stats_export(const char *path);
+
+/* called on every tick of the main loop (TICK_MS), recomputes the rates
+ * once a period and writes them out if exporting
+ */
+void stats_update(void);
+
+/* the latest rates as one line for the HUD */
+void stats_format(char *line, size_t size);
+
+void stats_close(void);
+
+#endif
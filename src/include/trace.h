@@ -0,0 +1,32 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* CLOCK_MONOTONIC stamps (ns) of one frame on its way to the terminal */
+struct frame_trace {
+    unsigned long   id;
+    uint64_t        capture;    /* driver timestamp */
+    uint64_t        dequeue;
+    uint64_t        decoded;
+    uint64_t        resized;
+    uint64_t        written;    /* the tty write returned */
+};
+
+/* numbers the frame and stamps the capture and the dequeue, capture thread */
+void trace_dequeued(struct frame_trace *trace, uint64_t capture);
+
+/* stamps the write and records the frame, render thread only */
+void trace_written(struct frame_trace *trace);
+
+/* keep every frame's stamps and write them as a Chrome trace to path on
+ * trace_close()
+ */
+int trace_open(const char *path);
+void trace_close(void);
+
+/* capture to tty latency percentiles and histogram of the recorded frames */
+void trace_summary(FILE *fp);
+
+#endif
@@ -0,0 +1,266 @@
+#include "include/luma.h"
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LUMA_X86
+#endif
+
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+static void luma_row_scalar(const uint8_t *rgb, uint8_t *grey, int n){
+    for (int i = 0; i < n; i++, rgb += 3) {
+        grey[i] = LUMA(rgb[0], rgb[1], rgb[2]);
+    }
+}
+
+static int always(void){
+    return 1;
+}
+
+#ifdef LUMA_X86
+
+/* pshufb masks gathering one channel of 16 RGB24 pixels out of the three
+   16 byte loads that hold them, -1 lanes are zeroed and or'd together */
+#define Z -1
+static const int8_t deinterleave[3][3][16] = {
+    { /* R */
+        {0, 3, 6, 9, 12, 15, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z},
+        {Z, Z, Z, Z, Z, Z, 2, 5, 8, 11, 14, Z, Z, Z, Z, Z},
+        {Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, 1, 4, 7, 10, 13}
+    },
+    { /* G */
+        {1, 4, 7, 10, 13, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z},
+        {Z, Z, Z, Z, Z, 0, 3, 6, 9, 12, 15, Z, Z, Z, Z, Z},
+        {Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, 2, 5, 8, 11, 14}
+    },
+    { /* B */
+        {2, 5, 8, 11, 14, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z},
+        {Z, Z, Z, Z, Z, 1, 4, 7, 10, 13, Z, Z, Z, Z, Z, Z},
+        {Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, 0, 3, 6, 9, 12, 15}
+    }
+};
+#undef Z
+
+__attribute__((target("ssse3")))
+static inline __m128i channel_ssse3(__m128i a, __m128i b, __m128i c, int ch){
+    return _mm_or_si128(
+        _mm_or_si128(
+            _mm_shuffle_epi8(a, _mm_loadu_si128((__m128i*)deinterleave[ch][0])),
+            _mm_shuffle_epi8(b, _mm_loadu_si128((__m128i*)deinterleave[ch][1]))
+        ),
+        _mm_shuffle_epi8(c, _mm_loadu_si128((__m128i*)deinterleave[ch][2]))
+    );
+}
+
+/* 8 lanes of 16 bit luma, the sum tops out at 65408 so it can't wrap */
+__attribute__((target("ssse3")))
+static inline __m128i weigh_ssse3(__m128i r, __m128i g, __m128i b){
+
+    __m128i y = _mm_mullo_epi16(r, _mm_set1_epi16(LUMA_R));
+
+    y = _mm_add_epi16(y, _mm_mullo_epi16(g, _mm_set1_epi16(LUMA_G)));
+    y = _mm_add_epi16(y, _mm_mullo_epi16(b, _mm_set1_epi16(LUMA_B)));
+    y = _mm_add_epi16(y, _mm_set1_epi16(128));
+
+    return _mm_srli_epi16(y, 8);
+}
+
+__attribute__((target("ssse3")))
+static void luma_row_ssse3(const uint8_t *rgb, uint8_t *grey, int n){
+
+    const __m128i zero = _mm_setzero_si128();
+    __m128i a, b, c, r, g, bl, lo, hi;
+    int i;
+
+    for (i = 0; i + 16 <= n; i += 16, rgb += 48) {
+        a = _mm_loadu_si128((__m128i*)rgb);
+        b = _mm_loadu_si128((__m128i*)(rgb + 16));
+        c = _mm_loadu_si128((__m128i*)(rgb + 32));
+
+        r = channel_ssse3(a, b, c, 0);
+        g = channel_ssse3(a, b, c, 1);
+        bl = channel_ssse3(a, b, c, 2);
+
+        lo = weigh_ssse3(
+            _mm_unpacklo_epi8(r, zero),
+            _mm_unpacklo_epi8(g, zero),
+            _mm_unpacklo_epi8(bl, zero)
+        );
+        hi = weigh_ssse3(
+            _mm_unpackhi_epi8(r, zero),
+            _mm_unpackhi_epi8(g, zero),
+            _mm_unpackhi_epi8(bl, zero)
+        );
+
+        _mm_storeu_si128((__m128i*)(grey + i), _mm_packus_epi16(lo, hi));
+    }
+
+    luma_row_scalar(rgb, grey + i, n - i);
+}
+
+static int has_ssse3(void){
+    return __builtin_cpu_supports("ssse3");
+}
+
+__attribute__((target("avx2")))
+static inline __m256i load2_avx2(const uint8_t *lo, const uint8_t *hi){
+    return _mm256_inserti128_si256(
+        _mm256_castsi128_si256(_mm_loadu_si128((__m128i*)lo)),
+        _mm_loadu_si128((__m128i*)hi),
+        1
+    );
+}
+
+__attribute__((target("avx2")))
+static inline __m256i channel_avx2(__m256i a, __m256i b, __m256i c, int ch){
+    return _mm256_or_si256(
+        _mm256_or_si256(
+            _mm256_shuffle_epi8(a, _mm256_broadcastsi128_si256(
+                _mm_loadu_si128((__m128i*)deinterleave[ch][0]))),
+            _mm256_shuffle_epi8(b, _mm256_broadcastsi128_si256(
+                _mm_loadu_si128((__m128i*)deinterleave[ch][1])))
+        ),
+        _mm256_shuffle_epi8(c, _mm256_broadcastsi128_si256(
+            _mm_loadu_si128((__m128i*)deinterleave[ch][2])))
+    );
+}
+
+__attribute__((target("avx2")))
+static inline __m256i weigh_avx2(__m256i r, __m256i g, __m256i b){
+
+    __m256i y = _mm256_mullo_epi16(r, _mm256_set1_epi16(LUMA_R));
+
+    y = _mm256_add_epi16(y, _mm256_mullo_epi16(g, _mm256_set1_epi16(LUMA_G)));
+    y = _mm256_add_epi16(y, _mm256_mullo_epi16(b, _mm256_set1_epi16(LUMA_B)));
+    y = _mm256_add_epi16(y, _mm256_set1_epi16(128));
+
+    return _mm256_srli_epi16(y, 8);
+}
+
+/* pshufb doesn't cross 128 bit lanes, so the low lane gets pixels 0-15 and
+   the high lane pixels 16-31, unpack and pack stay in lane as well and put
+   them back in order */
+__attribute__((target("avx2")))
+static void luma_row_avx2(const uint8_t *rgb, uint8_t *grey, int n){
+
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i a, b, c, r, g, bl, lo, hi;
+    int i;
+
+    for (i = 0; i + 32 <= n; i += 32, rgb += 96) {
+        a = load2_avx2(rgb, rgb + 48);
+        b = load2_avx2(rgb + 16, rgb + 64);
+        c = load2_avx2(rgb + 32, rgb + 80);
+
+        r = channel_avx2(a, b, c, 0);
+        g = channel_avx2(a, b, c, 1);
+        bl = channel_avx2(a, b, c, 2);
+
+        lo = weigh_avx2(
+            _mm256_unpacklo_epi8(r, zero),
+            _mm256_unpacklo_epi8(g, zero),
+            _mm256_unpacklo_epi8(bl, zero)
+        );
+        hi = weigh_avx2(
+            _mm256_unpackhi_epi8(r, zero),
+            _mm256_unpackhi_epi8(g, zero),
+            _mm256_unpackhi_epi8(bl, zero)
+        );
+
+        _mm256_storeu_si256((__m256i*)(grey + i), _mm256_packus_epi16(lo, hi));
+    }
+
+    luma_row_ssse3(rgb, grey + i, n - i);
+}
+
+static int has_avx2(void){
+    return __builtin_cpu_supports("avx2");
+}
+
+#endif /* LUMA_X86 */
+
+#ifdef __ARM_NEON
+
+static void luma_row_neon(const uint8_t *rgb, uint8_t *grey, int n){
+
+    uint8x16x3_t px;
+    uint16x8_t lo, hi;
+    int i;
+
+    for (i = 0; i + 16 <= n; i += 16, rgb += 48) {
+        px = vld3q_u8(rgb);
+
+        lo = vmull_u8(vget_low_u8(px.val[0]), vdup_n_u8(LUMA_R));
+        lo = vmlal_u8(lo, vget_low_u8(px.val[1]), vdup_n_u8(LUMA_G));
+        lo = vmlal_u8(lo, vget_low_u8(px.val[2]), vdup_n_u8(LUMA_B));
+
+        hi = vmull_u8(vget_high_u8(px.val[0]), vdup_n_u8(LUMA_R));
+        hi = vmlal_u8(hi, vget_high_u8(px.val[1]), vdup_n_u8(LUMA_G));
+        hi = vmlal_u8(hi, vget_high_u8(px.val[2]), vdup_n_u8(LUMA_B));
+
+        /* rounding narrow adds the 128 before the shift */
+        vst1q_u8(grey + i, vcombine_u8(vrshrn_n_u16(lo, 8), vrshrn_n_u16(hi, 8)));
+    }
+
+    luma_row_scalar(rgb, grey + i, n - i);
+}
+
+#endif /* __ARM_NEON */
+
+const struct luma_kernel luma_kernels[] = {
+    { "scalar", luma_row_scalar, always },
+#ifdef LUMA_X86
+    { "ssse3",  luma_row_ssse3,  has_ssse3 },
+    { "avx2",   luma_row_avx2,   has_avx2 },
+#endif
+#ifdef __ARM_NEON
+    { "neon",   luma_row_neon,   always },
+#endif
+};
+
+const int n_luma_kernels = sizeof(luma_kernels)/sizeof(*luma_kernels);
+
+luma_row_t rgb_to_luma_row = luma_row_scalar;
+
+static const char *luma_kernel_name = "scalar";
+
+/* the table is ordered slowest to fastest, take the last one that runs */
+void init_luma(void){
+
+#ifdef LUMA_X86
+    __builtin_cpu_init();
+#endif
+
+    for (int i = 0; i < n_luma_kernels; i++) {
+        if (luma_kernels[i].supported()) {
+            rgb_to_luma_row = luma_kernels[i].row;
+            luma_kernel_name = luma_kernels[i].name;
+        }
+    }
+}
+
+int set_luma_kernel(const char *name){
+
+    for (int i = 0; i < n_luma_kernels; i++) {
+        if (0 == strcmp(luma_kernels[i].name, name)) {
+            if (!luma_kernels[i].supported()) {
+                fprintf(stderr, "luma: %s isn't supported on this cpu\n", name);
+                return 1;
+            }
+            rgb_to_luma_row = luma_kernels[i].row;
+            luma_kernel_name = luma_kernels[i].name;
+            return 0;
+        }
+    }
+
+    fprintf(stderr, "luma: no kernel called %s\n", name);
+    return 1;
+}
+
+const char *get_luma_kernel(void){
+    return luma_kernel_name;
+}
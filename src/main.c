@@ -12,391 +12,1120 @@
 
 #include <getopt.h>
 #include <ncurses.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <signal.h>
 
-#include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
-#include <sys/stat.h>
-#include <sys/types.h>
-#include <sys/time.h>
-#include <sys/mman.h>
-#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 
 #include <linux/videodev2.h>
 
 #include "include/disp.h"
 #include "include/img.h"
-
-#define CLEAR(x) memset(&(x), 0, sizeof(x))
-
-struct buffer {
-    void   *start;
-    size_t  length;
+#include "include/pool.h"
+#include "include/luma.h"
+#include "include/ring.h"
+#include "include/source.h"
+#include "include/stats.h"
+#include "include/trace.h"
+
+static const struct frame_source *source = &v4l2_source;
+static struct frame_format capture_format;
+
+static int              latest_only;    /* skip to the newest queued frame */
+
+/* zoom and pan, zoom << 32 | centre x << 16 | centre y with the centre in
+   ROI_ONE-ths of the frame, set by keys on the main thread and picked up by
+   whichever thread decodes, per frame */
+#define VIEW(zoom, x, y)    ((uint64_t)(zoom) << 32 | (uint64_t)(x) << 16 | (y))
+#define MAX_ZOOM            8
+
+static atomic_uint_least64_t view = VIEW(1, ROI_ONE / 2, ROI_ONE / 2);
+
+/* motion gating, once a frame came out like the last one drawn nothing is
+   drawn and only a frame every PROBE_NS is decoded, until one differs */
+#define PROBE_NS            250000000u
+
+static int              motion_threshold;   /* levels per cell, 0 is off */
+static atomic_int       still;
+static int              redraw;             /* draw the next one regardless */
+static uint64_t         last_probe;         /* by the thread taking frames */
+static image_t          reference;          /* the grid drawn last */
+static size_t           reference_capacity;
+
+/* half block colour output, the grids are RGB with two rows a cell */
+static enum colour_mode colour_mode;
+
+static enum dither_mode dither;
+
+/* grid pixels a terminal cell is drawn from */
+static int              cell_width = 1;
+static int              cell_height = 1;
+
+static int              hud_shown;
+static char             hud_line[128];
+static int              latency_report; /* print the histogram at exit */
+
+/* the main loop, the signals are blocked in every thread and read from a
+   signalfd instead */
+enum loop_event { EVENT_FRAME, EVENT_INPUT, EVENT_SIGNAL, EVENT_TIMER,
+                  N_LOOP_EVENTS };
+
+#define TICK_MS             100     /* stats and stall watchdog */
+#define STALL_MS            2000    /* no frame for this long restarts */
+
+static sigset_t         loop_signals;
+static atomic_uint_least64_t last_frame;  /* the capture thread's when pipelined */
+static unsigned long    restarts;
+
+/* fit mode, the capture format is renegotiated once the terminal size settled
+   and when the measured cost of a frame moved by more than a quarter */
+#define REFIT_PERIOD_NS     5000000000u
+#define REFIT_SETTLE_NS     500000000u
+
+static uint64_t         refit_time;     /* last look at the frame cost */
+static uint64_t         refit_due;      /* resized, refit from then on */
+static struct stats_snapshot refit_totals;
+static unsigned long    refits;
+
+/* pipelined mode, capture gets a thread, so does every processing worker and
+   the main thread renders, the stages pass source buffer and grid indices over
+   rings, the frames are dealt out to the workers in turn so several of them
+   can be decoded at once */
+#define CAPTURE_RING_SIZE   2
+#define RENDER_RING_SIZE    2
+#define N_GRIDS             (RENDER_RING_SIZE + 2) /* + processing + render */
+#define MAX_WORKERS         8
+#define STAGE_POLL_MS       10
+
+struct worker {
+    pthread_t           tid;
+    struct ring         in;         /* frames, capture -> worker */
+    struct ring         out;        /* grids, worker -> render */
+    struct ring         free;       /* grids, render -> worker */
+    image_t             grids[N_GRIDS];
+    size_t              grid_capacity[N_GRIDS];
+    struct frame_trace  traces[N_GRIDS];
+    jpeg_decoder_t      decoder;    /* a TurboJPEG handle of its own */
+    unsigned int        idle_slot;  /* grid it held when it was stopped */
 };
 
-static char             *dev_name;
-static int              fd = -1;
-struct buffer           *buffers;
-static unsigned int     n_buffers;
+static int              pipelined;
+static int              n_workers = 1;
+static struct worker    workers[MAX_WORKERS];
+static atomic_int       quit;
+static atomic_int       halt;           /* stop the stages but keep going */
+static struct frame     *captured;      /* last frame in each source buffer */
+static struct frame_trace *captured_traces;
+static unsigned long    next_shown;     /* frames before this one are late */
 
+static jpeg_decoder_t   decoder;
 static image_t          decompressed_image;
-static image_t          gray_buffer;
 static image_t          resized_buffer;
+static size_t           resized_capacity;
 
-static int xioctl(int fh, int request, void *arg);
-static void errno_exit(const char *s);
+/* terminal size the grids are made for, width << 16 | height, set by the
+   render thread and picked up by whichever thread resizes the frames */
+#define GEOMETRY(w, h)      ((unsigned int)(w) << 16 | (h))
+#define GEOMETRY_WIDTH(g)   ((g) >> 16)
+#define GEOMETRY_HEIGHT(g)  ((g) & 0xffff)
 
-static void init_image_processing(){
+static atomic_uint      geometry;
+
+/* grid for a terminal of x by y cells */
+static unsigned int grid_geometry(unsigned int x, unsigned int y){
+    return GEOMETRY(cell_width * x, cell_height * y);
+}
+
+/* resize a grid in place, only growing past its capacity allocates */
+static void fit_grid(image_t *grid, size_t *capacity, unsigned int g){
 
-    int camera_y, camera_x; /* camera dimensions */
-    unsigned int terminal_y, terminal_x; /* camera dimensions */
-    struct v4l2_format fmt;
+    int depth = colour_mode ? 3 : 1;
+    size_t size = (size_t)GEOMETRY_WIDTH(g) * GEOMETRY_HEIGHT(g) * depth;
+
+    if (size > *capacity) {
+        free(grid->image);
+        *capacity = WITH_HEADROOM(size);
+        grid->image = (uint8_t*)malloc(*capacity);
+        if (!grid->image) {
+            uninit_window();
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    grid->width = GEOMETRY_WIDTH(g);
+    grid->height = GEOMETRY_HEIGHT(g);
+    grid->depth = depth;
+    grid->stride = grid->width * depth;
+}
 
-    CLEAR(fmt);
+/* decode straight to what the grids hold, grey or RGB */
+static void init_decoder(jpeg_decoder_t *dec){
+
+    unsigned int g = atomic_load(&geometry);
+
+    if (V4L2_PIX_FMT_MJPEG != capture_format.pixelformat) {
+        return;
+    }
+
+    if (init_jpeg_decoder(
+            dec, capture_format.width, capture_format.height,
+            colour_mode ? 3 : 1)) {
+        exit(EXIT_FAILURE);
+    }
+
+    set_jpeg_decoder_target(dec, GEOMETRY_WIDTH(g), GEOMETRY_HEIGHT(g));
+}
+
+static void uninit_decoder(jpeg_decoder_t *dec){
+    if (V4L2_PIX_FMT_MJPEG == capture_format.pixelformat) {
+        uninit_jpeg_decoder(dec);
+    }
+}
+
+static void alloc_captured(void){
+
+    free(captured);
+    free(captured_traces);
+    captured = calloc(source->n_buffers(), sizeof(*captured));
+    captured_traces = calloc(source->n_buffers(), sizeof(*captured_traces));
+    if (!captured || !captured_traces) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void init_pipeline(void){
+
+    struct worker *w;
+    unsigned int dropped;
+
+    alloc_captured();
+
+    for (int i = 0; i < n_workers; i++) {
+        w = &workers[i];
+        if (ring_init(&w->in, CAPTURE_RING_SIZE) ||
+            ring_init(&w->out, RENDER_RING_SIZE) ||
+            ring_init(&w->free, N_GRIDS)) {
+            exit(EXIT_FAILURE);
+        }
+
+        for (unsigned int j = 0; j < N_GRIDS; j++) {
+            fit_grid(&w->grids[j], &w->grid_capacity[j],
+                     atomic_load(&geometry));
+            ring_push(&w->free, j, &dropped);
+        }
+
+        init_decoder(&w->decoder);
+    }
+}
+
+static void uninit_pipeline(void){
+
+    struct worker *w;
+
+    for (int i = 0; i < n_workers; i++) {
+        w = &workers[i];
+        ring_uninit(&w->in);
+        ring_uninit(&w->out);
+        ring_uninit(&w->free);
+
+        for (unsigned int j = 0; j < N_GRIDS; j++) {
+            free(w->grids[j].image);
+            w->grids[j].image = NULL;
+            w->grid_capacity[j] = 0;
+        }
 
-    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    if (-1 == xioctl(fd, VIDIOC_G_FMT, &fmt)){
-        errno_exit("VIDIOC_G_FMT");
+        uninit_decoder(&w->decoder);
     }
 
-    camera_y = fmt.fmt.pix.height;
-    camera_x = fmt.fmt.pix.width;
+    free(captured);
+    free(captured_traces);
+    captured = NULL;
+    captured_traces = NULL;
+}
+
+static void init_image_processing(){
 
-    gray_buffer.height = camera_y;
-    gray_buffer.width = camera_x;
-    gray_buffer.depth = 1;
-    gray_buffer.image = (uint8_t*)malloc(camera_y * camera_x);
+    unsigned int terminal_y, terminal_x;
+
+    source->format(&capture_format);
 
     get_window_xy(&terminal_x, &terminal_y);
 
-    resized_buffer.height = terminal_y;
-    resized_buffer.width = terminal_x;
-    resized_buffer.depth = 1;
-    resized_buffer.image = (uint8_t*)malloc(terminal_y * terminal_x);
+    init_luma();
+
+    atomic_store(&geometry, grid_geometry(terminal_x, terminal_y));
+
+    if (pipelined) {
+        init_pipeline();
+    }
+    else {
+        init_decoder(&decoder);
+        fit_grid(&resized_buffer, &resized_capacity, atomic_load(&geometry));
+    }
 
 }
 
 static void uninit_image_processing(){
-    free(gray_buffer.image);
+    if (pipelined) {
+        uninit_pipeline();
+    }
+    else {
+        uninit_decoder(&decoder);
+    }
+    uninit_resize();
+    free(reference.image);
+    reference.image = NULL;
+    reference_capacity = 0;
     free(resized_buffer.image);
+    resized_buffer.image = NULL;
+    resized_capacity = 0;
+    pool_uninit();
 }
 
-static void errno_exit(const char *s){
-    fprintf(stderr, "%s error %d, %s\n", s, errno, strerror(errno));
-    exit(EXIT_FAILURE);
+/* wrap an uncompressed frame in an image_t, the pixels stay in the mmap'd
+   buffer (or recording) and the resize reads the Y (or RGB) samples straight
+   from it */
+static int raw_view(void *p, int size, image_t *dst){
+
+    dst->image = (uint8_t*)p;
+    dst->width = capture_format.width;
+    dst->height = capture_format.height;
+    dst->stride = capture_format.stride;
+
+    switch (capture_format.pixelformat) {
+    case V4L2_PIX_FMT_YUYV:
+        dst->depth = 2;
+        break;
+    case V4L2_PIX_FMT_UYVY:
+        /* Y is the second byte of every pair */
+        dst->image++;
+        dst->depth = 2;
+        break;
+    case V4L2_PIX_FMT_NV12:
+    case V4L2_PIX_FMT_GREY:
+        /* the Y plane comes first and is all we need */
+        dst->depth = 1;
+        break;
+    case V4L2_PIX_FMT_RGB24:
+        dst->depth = 3;
+        break;
+    default:
+        return 1;
+    }
+
+    /* short frames happen when the driver drops data, skip them */
+    if (size < dst->stride * dst->height) {
+        return 1;
+    }
+
+    return 0;
 }
 
-static int xioctl(int fh, int request, void *arg){
+static void get_roi(roi_t *roi){
 
+    uint64_t v = atomic_load(&view);
+
+    roi->width = ROI_ONE / (int)(v >> 32);
+    roi->height = roi->width;
+    roi->x = (int)(v >> 16 & 0xffff) - roi->width / 2;
+    roi->y = (int)(v & 0xffff) - roi->height / 2;
+}
+
+/* zoom by a power of two, pan by quarters of the visible part, the view
+   never leaves the frame */
+static void move_view(int zoom_shift, int dx, int dy){
+
+    uint64_t v = atomic_load(&view);
+    int zoom = (int)(v >> 32);
+    int x = (int)(v >> 16 & 0xffff);
+    int y = (int)(v & 0xffff);
+    int half;
+
+    if (zoom_shift > 0 && zoom < MAX_ZOOM) {
+        zoom <<= 1;
+    }
+    else if (zoom_shift < 0 && zoom > 1) {
+        zoom >>= 1;
+    }
+
+    half = ROI_ONE / zoom / 2;
+    x += dx * half / 2;
+    y += dy * half / 2;
+    x = x < half ? half : x > ROI_ONE - half ? ROI_ONE - half : x;
+    y = y < half ? half : y > ROI_ONE - half ? ROI_ONE - half : y;
+
+    atomic_store(&view, VIEW(zoom, x, y));
+}
+
+/* decode or wrap a captured frame, only as much of it as is in view, returns
+   1 when it has to be dropped */
+static int prepare_frame(jpeg_decoder_t *dec, void *p, int size,
+                         image_t *dst){
+
+    uint64_t start = stats_now();
+    image_t whole;
+    roi_t roi;
     int r;
 
-    do {
-        r = ioctl(fh, request, arg);
-    } while (-1 == r && EINTR == errno);
+    get_roi(&roi);
+
+    if (V4L2_PIX_FMT_MJPEG == capture_format.pixelformat) {
+        /* a corrupt frame is dropped, the next one is likely fine */
+        r = decompress_jpeg_roi(dec, p, size, &roi, dst);
+    }
+    else {
+        r = raw_view(p, size, &whole);
+        if (!r) {
+            roi_view(&whole, &roi, dst);
+        }
+    }
+
+    stats_time(STAT_DECODE, start);
+    if (r) {
+        stats_count(STAT_DROPPED, 1);
+    }
 
     return r;
 }
 
-static void process_image(void *p, int size){
+/* where the colour of a prepared frame is, decoded MJPEG is RGB already */
+static enum colour_layout frame_layout(void){
+
+    switch (capture_format.pixelformat) {
+    case V4L2_PIX_FMT_YUYV:
+        return LAYOUT_YUYV;
+    case V4L2_PIX_FMT_UYVY:
+        return LAYOUT_UYVY;
+    case V4L2_PIX_FMT_RGB24:
+    case V4L2_PIX_FMT_MJPEG:
+        return LAYOUT_RGB;
+    default:
+        /* NV12's chroma plane isn't read, it's drawn in grey */
+        return LAYOUT_GREY;
+    }
+}
+
+static void downscale_frame(image_t *src, image_t *dst){
+
+    uint64_t start = stats_now();
+    uint8_t curve[256];
+
+    if (colour_mode) {
+        resize_to_rgb(src, frame_layout(), dst);
+    }
+    else if (3 == src->depth) {
+        /* convert only the pixels the terminal grid samples */
+        resize_rgb_to_grey(src, dst);
+    }
+    else {
+        resize_image(src, dst);
+    }
+
+    /* the tone curve copied once, a key may rebuild it meanwhile */
+    if (!colour_mode) {
+        get_tone(curve);
+        dither_image(dst, get_glyph_levels(), curve, dither);
+    }
+
+    stats_time(STAT_RESIZE, start);
+}
+
+/* 1 when the frame is to be decoded, while still only the probes are */
+static int probe_frame(void){
+
+    uint64_t t;
 
-    decompress_jpeg(p, size, &decompressed_image);
+    if (!atomic_load(&still)) {
+        return 1;
+    }
 
-    rgb_to_grey(&decompressed_image, &gray_buffer);
-    resize_image(&gray_buffer, &resized_buffer);
+    t = stats_now();
+    if (t - last_probe < PROBE_NS) {
+        stats_count(STAT_IDLE, 1);
+        return 0;
+    }
+    last_probe = t;
+
+    return 1;
+}
+
+/* 1 when the grid is worth drawing, the last grid drawn is what it's
+   compared with, so a slow change adds up until it shows */
+static int gate_frame(image_t *grid){
+
+    if (!motion_threshold) {
+        return 1;
+    }
+
+    if (!redraw && reference.width == grid->width &&
+        reference.height == grid->height &&
+        !image_changed(&reference, grid, motion_threshold)) {
+        atomic_store(&still, 1);
+        stats_count(STAT_IDLE, 1);
+        return 0;
+    }
+
+    redraw = 0;
+    atomic_store(&still, 0);
+
+    fit_grid(&reference, &reference_capacity,
+             GEOMETRY(grid->width, grid->height));
+    for (int y = 0; y < grid->height; y++) {
+        memcpy(PIXEL_AT(&reference, 0, y), PIXEL_AT(grid, 0, y),
+               grid->width * grid->depth);
+    }
+
+    return 1;
+}
+
+static void show_frame(image_t *grid, struct frame_trace *trace){
+
+    uint64_t start = stats_now();
+
+    if (hud_shown) {
+        stats_format(hud_line, sizeof(hud_line));
+    }
 
     display_frame(
-        resized_buffer.image,
-        resized_buffer.width * resized_buffer.height,
-        resized_buffer.width
+        grid->image,
+        grid->width * grid->height,
+        grid->width
     );
 
-    free(decompressed_image.image);
+    trace_written(trace);
+    stats_time(STAT_DRAW, start);
+    stats_count(STAT_RENDERED, 1);
 }
 
-static int read_frame(void){
+/* returns 1 to quit */
+static int handle_key(int key){
 
-    struct v4l2_buffer buf;
+    /* whatever the key changed has to show even if nothing moved */
+    redraw = 1;
+    atomic_store(&still, 0);
 
-    CLEAR(buf);
+    switch (key) {
+    case 27: /* esc */
+    case 3:  /* ctrl-c, raw mode keeps it from becoming a SIGINT */
+        return 1;
+    case 'h':
+        hud_shown = !hud_shown;
+        set_hud(hud_shown ? hud_line : NULL);
+        break;
+    case '+':
+    case '=':
+        move_view(1, 0, 0);
+        break;
+    case '-':
+        move_view(-1, 0, 0);
+        break;
+    /* the picture is mirrored, left on screen is right in the frame */
+    case 'a':
+        move_view(0, 1, 0);
+        break;
+    case 'd':
+        move_view(0, -1, 0);
+        break;
+    case 'w':
+        move_view(0, 0, -1);
+        break;
+    case 's':
+        move_view(0, 0, 1);
+        break;
+    case ']':
+        adjust_tone(1, 0);
+        break;
+    case '[':
+        adjust_tone(-1, 0);
+        break;
+    case '.':
+        adjust_tone(0, 1);
+        break;
+    case ',':
+        adjust_tone(0, -1);
+        break;
+    case 't':
+        reset_tone();
+        break;
+    case '0':
+        atomic_store(&view, VIEW(1, ROI_ONE / 2, ROI_ONE / 2));
+        break;
+    }
 
-    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    buf.memory = V4L2_MEMORY_MMAP;
-    if (-1 == xioctl(fd, VIDIOC_DQBUF, &buf)) {
-        switch (errno) {
-        case EAGAIN:
-            return 0;
-        case EIO:
-            /* Could ignore EIO, see spec. */
-            /* fall through */
-        default:
-            errno_exit("VIDIOC_DQBUF");
-        }
+    return 0;
+}
+
+static void process_image(void *p, int size, struct frame_trace *trace){
+
+    if (prepare_frame(&decoder, p, size, &decompressed_image)) {
+        return;
+    }
+    trace->decoded = stats_now();
+
+    downscale_frame(&decompressed_image, &resized_buffer);
+    trace->resized = stats_now();
+
+    if (gate_frame(&resized_buffer)) {
+        show_frame(&resized_buffer, trace);
     }
+}
+
+static int read_frame(void){
 
-    assert(buf.index < n_buffers);
+    struct frame frame;
+    struct frame newer;
+    struct frame_trace trace;
 
-    process_image(buffers[buf.index].start, buf.bytesused);
+    if (!source->get(&frame)) {
+        return 0;
+    }
+    stats_count(STAT_CAPTURED, 1);
+
+    /* when processing fell behind, hand the stale frames straight back to
+       the source and only show the newest one */
+    while (latest_only && source->get(&newer)) {
+        source->put(&frame);
+        frame = newer;
+        stats_count(STAT_CAPTURED, 1);
+        stats_count(STAT_DROPPED, 1);
+    }
 
-    if (-1 == xioctl(fd, VIDIOC_QBUF, &buf)){
-        errno_exit("VIDIOC_QBUF");
+    if (probe_frame()) {
+        trace_dequeued(&trace, frame.timestamp);
+        process_image(frame.data, frame.size, &trace);
     }
 
+    source->put(&frame);
+
     return 1;
 }
 
-static void mainloop(void){
+/* the stages run until the viewer quits, or are halted for a moment while
+   the main thread changes the capture format under them */
+static int stages_running(void){
+    return !atomic_load(&quit) && !atomic_load(&halt);
+}
 
-    fd_set fds;
-    struct timeval tv;
+/* capture stage, takes frames from the source and hands their buffer index
+   on to the workers in turn, when the next one is behind the oldest buffer
+   waiting for it goes back to the source */
+static void *capture_thread(void *arg){
+
+    struct frame frame;
+    struct worker *w;
+    unsigned int dropped;
+    int next = 0;
     int r;
 
-    for (;;) {
-        FD_ZERO(&fds);
-        FD_SET(fd, &fds);
+    while (stages_running()) {
+        /* a stalled camera is waited out until the main thread restarts
+           it, the render thread stays responsive meanwhile */
+        r = source->wait(TICK_MS);
+        if (0 == r) {
+            continue;
+        }
+        if (-1 == r) {
+            atomic_store(&quit, 1);
+            break;
+        }
 
-        /* Timeout. */
-        tv.tv_sec = 1;
-        tv.tv_usec = 0;
+        if (!source->get(&frame)) {
+            continue;
+        }
+        stats_count(STAT_CAPTURED, 1);
+        atomic_store(&last_frame, stats_now());
 
-        r = select(fd + 1, &fds, NULL, NULL, &tv);
+        if (!probe_frame()) {
+            source->put(&frame);
+            continue;
+        }
 
-        if (-1 == r) {
-            if (EINTR == errno)
-                continue;
-            errno_exit("select");
+        captured[frame.index] = frame;
+        trace_dequeued(&captured_traces[frame.index], frame.timestamp);
+
+        w = &workers[next];
+        next = (next + 1) % n_workers;
+        if (ring_push(&w->in, frame.index, &dropped)) {
+            source->put(&captured[dropped]);
+            stats_count(STAT_DROPPED, 1);
         }
+    }
 
-        if (0 == r) {
-            fprintf(stderr, "select timeout\n");
-            exit(EXIT_FAILURE);
+    stats_release();
+
+    return NULL;
+}
+
+/* processing stage, the source buffer is returned as soon as its data has been
+   consumed and the grid goes to the render stage, or replaces the oldest one
+   waiting there */
+static void *process_thread(void *arg){
+
+    struct worker *w = (struct worker*)arg;
+    image_t src;
+    unsigned int index;
+    unsigned int slot = N_GRIDS;
+    unsigned int dropped;
+    unsigned int g, target = atomic_load(&geometry);
+    int decoded = V4L2_PIX_FMT_MJPEG == capture_format.pixelformat;
+
+    while (stages_running() && !ring_pop(&w->free, &slot)) {
+        ring_wait(&w->free, STAGE_POLL_MS);
+    }
+
+    while (stages_running()) {
+        if (!ring_pop(&w->in, &index)) {
+            ring_wait(&w->in, STAGE_POLL_MS);
+            continue;
         }
 
-        read_frame();
+        /* the decoder is this thread's, so a resize of the terminal is
+           picked up here between two frames */
+        g = atomic_load(&geometry);
+        if (g != target && decoded) {
+            set_jpeg_decoder_target(
+                &w->decoder, GEOMETRY_WIDTH(g), GEOMETRY_HEIGHT(g));
+        }
+        target = g;
 
-        switch (wgetch(stdscr)){
-        case 27: /* esc */
-            break;
-        default:
-            /* do nothing, repeat loop */
+        if (prepare_frame(&w->decoder, captured[index].data,
+                          captured[index].size, &src)) {
+            source->put(&captured[index]);
             continue;
         }
-        break;
+        w->traces[slot] = captured_traces[index];
+        w->traces[slot].decoded = stats_now();
+
+        /* a decoded frame lives in the decoder's buffer, raw ones are read
+           straight from the source's one until the resize is done */
+        if (decoded) {
+            source->put(&captured[index]);
+        }
+
+        fit_grid(&w->grids[slot], &w->grid_capacity[slot], target);
+        downscale_frame(&src, &w->grids[slot]);
+        w->traces[slot].resized = stats_now();
+
+        if (!decoded) {
+            source->put(&captured[index]);
+        }
+
+        if (ring_push(&w->out, slot, &dropped)) {
+            slot = dropped;
+            stats_count(STAT_DROPPED, 1);
+            continue;
+        }
+
+        slot = N_GRIDS;
+        while (stages_running() && !ring_pop(&w->free, &slot)) {
+            ring_wait(&w->free, STAGE_POLL_MS);
+        }
     }
+
+    /* handed back by the main thread once this one was joined */
+    w->idle_slot = slot;
+
+    /* the resize tables are per thread */
+    uninit_resize();
+    stats_release();
+
+    return NULL;
 }
 
-static void stop_capturing(void){
+/* reorder stage, the workers finish their frames in any order, the newest
+   one any of them has ready is drawn and everything older, waiting or still
+   to come, is recycled unseen, so frames are only ever shown in capture
+   order */
+static void render_latest(void){
+
+    struct worker *w;
+    struct worker *best = NULL;
+    unsigned int best_slot = 0;
+    unsigned int slot;
+    unsigned int dropped;
+
+    for (int i = 0; i < n_workers; i++) {
+        w = &workers[i];
+        ring_wait(&w->out, 0);
+
+        while (ring_pop(&w->out, &slot)) {
+            if (best && best->traces[best_slot].id > w->traces[slot].id) {
+                ring_push(&w->free, slot, &dropped);
+                stats_count(STAT_DROPPED, 1);
+                continue;
+            }
+            if (best) {
+                ring_push(&best->free, best_slot, &dropped);
+                stats_count(STAT_DROPPED, 1);
+            }
+            best = w;
+            best_slot = slot;
+        }
+    }
 
-    enum v4l2_buf_type type;
+    if (!best) {
+        return;
+    }
 
-    type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    if (-1 == xioctl(fd, VIDIOC_STREAMOFF, &type)){
-        errno_exit("VIDIOC_STREAMOFF");
+    /* a newer frame from another worker was drawn already */
+    if (best->traces[best_slot].id < next_shown) {
+        ring_push(&best->free, best_slot, &dropped);
+        stats_count(STAT_DROPPED, 1);
+        return;
     }
+
+    next_shown = best->traces[best_slot].id + 1;
+    if (gate_frame(&best->grids[best_slot])) {
+        show_frame(&best->grids[best_slot], &best->traces[best_slot]);
+    }
+    ring_push(&best->free, best_slot, &dropped);
 }
 
-static void start_capturing(void){
+static int add_event(int epoll_fd, int fd, enum loop_event event){
+
+    struct epoll_event ev;
 
-    unsigned int i;
-    enum v4l2_buf_type type;
+    ev.events = EPOLLIN;
+    ev.data.u32 = event;
 
-    for (i = 0; i < n_buffers; ++i) {
-        struct v4l2_buffer buf;
+    return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
 
-        CLEAR(buf);
-        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        buf.memory = V4L2_MEMORY_MMAP;
-        buf.index = i;
+/* frames come from the camera, or from any of the workers when pipelined */
+static int add_frame_events(int epoll_fd){
 
-        if (-1 == xioctl(fd, VIDIOC_QBUF, &buf))
-        errno_exit("VIDIOC_QBUF");
+    if (!pipelined) {
+        return add_event(epoll_fd, source->fd(), EVENT_FRAME);
     }
-    type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    if (-1 == xioctl(fd, VIDIOC_STREAMON, &type)){
-        errno_exit("VIDIOC_STREAMON");
+
+    for (int i = 0; i < n_workers; i++) {
+        if (add_event(epoll_fd, workers[i].out.event_fd, EVENT_FRAME)) {
+            return 1;
+        }
     }
+
+    return 0;
 }
 
-static void uninit_device(void){
+static int open_timer(void){
 
-    unsigned int i;
+    struct itimerspec its;
+    int timer_fd;
 
-    for (i = 0; i < n_buffers; ++i){
-        if (-1 == munmap(buffers[i].start, buffers[i].length)){
-            errno_exit("munmap");
-        }
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (-1 == timer_fd) {
+        return -1;
     }
-    free(buffers);
+
+    its.it_value.tv_sec = 0;
+    its.it_value.tv_nsec = TICK_MS * 1000000;
+    its.it_interval = its.it_value;
+    timerfd_settime(timer_fd, 0, &its, NULL);
+
+    return timer_fd;
 }
 
-static void init_mmap(void){
+static pthread_t        capture_tid;
 
-    struct v4l2_requestbuffers req;
+static void start_stages(void){
 
-    CLEAR(req);
+    pthread_create(&capture_tid, NULL, capture_thread, NULL);
+    for (int i = 0; i < n_workers; i++) {
+        pthread_create(&workers[i].tid, NULL, process_thread, &workers[i]);
+    }
+}
 
-    req.count = 4;
-    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    req.memory = V4L2_MEMORY_MMAP;
+/* every grid a worker held goes back to its free ring */
+static void stop_stages(void){
 
-    if (-1 == xioctl(fd, VIDIOC_REQBUFS, &req)) {
-        if (EINVAL == errno) {
-            fprintf(stderr, "%s does not support "
-            "memory mappingn", dev_name);
-            exit(EXIT_FAILURE);
-        }
-        else {
-            errno_exit("VIDIOC_REQBUFS");
+    struct worker *w;
+    unsigned int dropped;
+
+    atomic_store(&halt, 1);
+    pthread_join(capture_tid, NULL);
+    for (int i = 0; i < n_workers; i++) {
+        w = &workers[i];
+        pthread_join(w->tid, NULL);
+        if (w->idle_slot < N_GRIDS) {
+            ring_push(&w->free, w->idle_slot, &dropped);
         }
     }
+    atomic_store(&halt, 0);
+}
 
-    if (req.count < 2) {
-        fprintf(
-            stderr,
-            "Insufficient buffer memory on %s\n",
-            dev_name
-        );
-        exit(EXIT_FAILURE);
+/* every buffer went back to the source with a restarted stream, whatever
+   the rings still point at is gone, the grids are recycled */
+static void drain_pipeline(void){
+
+    struct worker *w;
+    unsigned int value;
+    unsigned int dropped;
+
+    for (int i = 0; i < n_workers; i++) {
+        w = &workers[i];
+        while (ring_pop(&w->in, &value));
+        while (ring_pop(&w->out, &value)) {
+            ring_push(&w->free, value, &dropped);
+        }
     }
+}
 
-    buffers = calloc(req.count, sizeof(*buffers));
+/* the stream came back in a new format, the decoders are made for it */
+static void reset_pipeline(void){
 
-    if (!buffers) {
-        fprintf(stderr, "Out of memory\n");
-        exit(EXIT_FAILURE);
+    drain_pipeline();
+
+    for (int i = 0; i < n_workers; i++) {
+        uninit_decoder(&workers[i].decoder);
+        init_decoder(&workers[i].decoder);
     }
 
-    for (n_buffers = 0; n_buffers < req.count; ++n_buffers) {
-        struct v4l2_buffer buf;
+    alloc_captured();
+}
+
+/* a camera that stopped delivering gets its stream restarted, a recording
+   can't stall, long gaps in it are real, when pipelined the stages are
+   halted meanwhile, they hold the source buffers the restart takes back */
+static void check_stall(void){
 
-        CLEAR(buf);
+    if (source == &file_source ||
+        stats_now() - atomic_load(&last_frame) <
+        (uint64_t)STALL_MS * 1000000u) {
+        return;
+    }
 
-        buf.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        buf.memory = V4L2_MEMORY_MMAP;
-        buf.index  = n_buffers;
+    if (pipelined) {
+        stop_stages();
+    }
 
-        if (-1 == xioctl(fd, VIDIOC_QUERYBUF, &buf)){
-            errno_exit("VIDIOC_QUERYBUF");
-        }
+    source->stop();
+    source->start();
 
-        buffers[n_buffers].length = buf.length;
-        buffers[n_buffers].start =
-        mmap(NULL /* start anywhere */,
-              buf.length,
-            PROT_READ | PROT_WRITE /* required */,
-            MAP_SHARED /* recommended */,
-            fd, buf.m.offset\
-        );
-
-        if (MAP_FAILED == buffers[n_buffers].start)
-            errno_exit("mmap");
-        }
+    if (pipelined) {
+        drain_pipeline();
+        start_stages();
+    }
+
+    restarts++;
+    atomic_store(&last_frame, stats_now());
 }
 
-static void init_device(void){
+/* renegotiate the capture format, when pipelined the stages are halted
+   meanwhile, they own the decoders and the source buffers */
+static void refit_stream(void){
 
-    struct v4l2_capability cap;
-    struct v4l2_cropcap cropcap;
-    struct v4l2_crop crop;
-    struct v4l2_format fmt;
-    unsigned int min;
+    if (pipelined) {
+        stop_stages();
+    }
 
-    if (-1 == xioctl(fd, VIDIOC_QUERYCAP, &cap)) {
-        if (EINVAL == errno) {
-            fprintf(stderr, "%s is no V4L2 device\n",
-                 dev_name);
-            exit(EXIT_FAILURE);
-        } else {
-            errno_exit("VIDIOC_QUERYCAP");
+    if (source->refit()) {
+        source->format(&capture_format);
+        if (pipelined) {
+            reset_pipeline();
+        }
+        else {
+            uninit_decoder(&decoder);
+            init_decoder(&decoder);
         }
+        refits++;
     }
 
-    if (!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE)) {
-        fprintf(stderr, "%s is no video capture device\n",
-             dev_name);
-        exit(EXIT_FAILURE);
+    if (pipelined) {
+        start_stages();
     }
 
-    if (!(cap.capabilities & V4L2_CAP_STREAMING)) {
-        fprintf(stderr, "%s does not support streaming i/o\n",
-             dev_name);
-        exit(EXIT_FAILURE);
-    }
+    atomic_store(&last_frame, stats_now());
+}
 
-    /* Select video input, video standard and tune here. */
+/* average time of a stage per frame since the last look */
+static uint64_t stage_cost(struct stats_snapshot *now, enum stat_stage s){
 
-    CLEAR(cropcap);
+    uint64_t calls = now->stage_calls[s] - refit_totals.stage_calls[s];
 
-    cropcap.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    return calls ? (now->stage_ns[s] - refit_totals.stage_ns[s]) / calls : 0;
+}
 
-    if (0 == xioctl(fd, VIDIOC_CROPCAP, &cropcap)) {
-        crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        crop.c = cropcap.defrect; /* reset to default */
+/* when pipelined the slowest stage sets the pace, otherwise all of them one
+   after the other, a quarter is added for the odd slow frame */
+static void check_refit(void){
 
-        if (-1 == xioctl(fd, VIDIOC_S_CROP, &crop)) {
-            switch (errno) {
-            case EINVAL:
-                /* Cropping not supported. */
-                break;
-            default:
-                /* Errors ignored. */
-                break;
-            }
-        }
-    } else {
-        /* Errors ignored. */
-    }
+    struct stats_snapshot now;
+    uint64_t t = stats_now();
+    uint64_t process, draw, cost;
+    uint64_t current = source_config.min_interval_ns;
+    unsigned int g;
+    int due = 0;
 
-    /* set RGB24 format */
-    CLEAR(fmt);
-    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    if (-1 == xioctl(fd, VIDIOC_G_FMT, &fmt)){
-        errno_exit("VIDIOC_G_FMT");
+    if (!source_config.fit) {
+        return;
     }
 
-    /* Buggy driver paranoia. */
-    min = fmt.fmt.pix.width * 2;
-    if (fmt.fmt.pix.bytesperline < min){
-        fmt.fmt.pix.bytesperline = min;
+    if (refit_due && t >= refit_due) {
+        g = atomic_load(&geometry);
+        source_config.fit_width = GEOMETRY_WIDTH(g);
+        source_config.fit_height = GEOMETRY_HEIGHT(g);
+        refit_due = 0;
+        due = 1;
     }
 
-    min = fmt.fmt.pix.bytesperline * fmt.fmt.pix.height;
-    if (fmt.fmt.pix.sizeimage < min){
-        fmt.fmt.pix.sizeimage = min;
+    if (t - refit_time >= REFIT_PERIOD_NS) {
+        stats_read(&now);
+        process = stage_cost(&now, STAT_DECODE) +
+                  stage_cost(&now, STAT_RESIZE);
+        draw = stage_cost(&now, STAT_DRAW);
+        cost = pipelined ? (process > draw ? process : draw) : process + draw;
+        cost += cost / 4;
+
+        if (refit_time && draw &&
+            (cost > current + current / 4 || cost < current - current / 4)) {
+            source_config.min_interval_ns = cost;
+            due = 1;
+        }
+
+        refit_totals = now;
+        refit_time = t;
     }
 
-    init_mmap();
+    if (due) {
+        refit_stream();
+    }
 }
 
-static void close_device(void){
+/* the window changed size, frames from now on are resized to it, the stream
+   keeps going, grids already on their way are clipped to the new size */
+static void resize_grids(void){
 
-    if (-1 == close(fd))
-        errno_exit("close");
+    unsigned int x, y;
+    unsigned int g;
 
-    fd = -1;
-}
+    get_window_xy(&x, &y);
+    g = grid_geometry(x, y);
+    atomic_store(&geometry, g);
 
-static void open_device(void){
+    redraw = 1;
+    atomic_store(&still, 0);
 
-    struct stat st;
+    /* a new capture size waits until the size stopped changing */
+    if (source_config.fit) {
+        refit_due = stats_now() + REFIT_SETTLE_NS;
+    }
 
-    if (-1 == stat(dev_name, &st)) {
-        fprintf(stderr, "Cannot identify '%s': %d, %s\n",
-             dev_name, errno, strerror(errno));
-        exit(EXIT_FAILURE);
+    /* when pipelined the processing thread takes it from here */
+    if (pipelined) {
+        return;
     }
 
-    if (!S_ISCHR(st.st_mode)) {
-        fprintf(stderr, "%s is no devicen", dev_name);
-        exit(EXIT_FAILURE);
+    if (V4L2_PIX_FMT_MJPEG == capture_format.pixelformat) {
+        set_jpeg_decoder_target(
+            &decoder, GEOMETRY_WIDTH(g), GEOMETRY_HEIGHT(g));
     }
+    fit_grid(&resized_buffer, &resized_capacity, g);
+}
 
-    fd = open(dev_name, O_RDWR /* required */ | O_NONBLOCK, 0);
+/* everything the main thread waits for goes through one epoll set: frames
+   (from the camera, or from the processing thread when pipelined), keys,
+   signals and a tick for the stats and the stall watchdog */
+static void mainloop(void){
 
-    if (-1 == fd) {
-        fprintf(stderr, "Cannot open '%s': %d, %s\n",
-             dev_name, errno, strerror(errno));
+    struct epoll_event events[N_LOOP_EVENTS + MAX_WORKERS];
+    struct signalfd_siginfo si;
+    uint64_t expirations;
+    int epoll_fd, signal_fd, timer_fd;
+    int n, key, r;
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    signal_fd = signalfd(-1, &loop_signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    timer_fd = open_timer();
+
+    if (-1 == epoll_fd || -1 == signal_fd || -1 == timer_fd ||
+        add_frame_events(epoll_fd) ||
+        add_event(epoll_fd, STDIN_FILENO, EVENT_INPUT) ||
+        add_event(epoll_fd, signal_fd, EVENT_SIGNAL) ||
+        add_event(epoll_fd, timer_fd, EVENT_TIMER)) {
+        uninit_window();
+        fprintf(stderr, "main loop set-up error %d, %s\n",
+             errno, strerror(errno));
         exit(EXIT_FAILURE);
     }
+
+    if (pipelined) {
+        start_stages();
+    }
+
+    atomic_store(&last_frame, stats_now());
+
+    while (!atomic_load(&quit)) {
+        n = epoll_wait(epoll_fd, events, N_LOOP_EVENTS + MAX_WORKERS, -1);
+        if (-1 == n) {
+            if (EINTR == errno) {
+                continue;
+            }
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            switch (events[i].data.u32) {
+            case EVENT_FRAME:
+                if (pipelined) {
+                    render_latest();
+                    break;
+                }
+
+                r = source->wait(0);
+                if (-1 == r) {
+                    /* the recording is over */
+                    atomic_store(&quit, 1);
+                }
+                else if (r && read_frame()) {
+                    atomic_store(&last_frame, stats_now());
+                }
+                break;
+
+            case EVENT_INPUT:
+                while (ERR != (key = get_key())) {
+                    if (handle_key(key)) {
+                        atomic_store(&quit, 1);
+                    }
+                }
+                break;
+
+            case EVENT_SIGNAL:
+                while (sizeof(si) == read(signal_fd, &si, sizeof(si))) {
+                    if (SIGWINCH != si.ssi_signo) {
+                        atomic_store(&quit, 1);
+                    }
+                    else if (resize_window()) {
+                        resize_grids();
+                    }
+                }
+                break;
+
+            case EVENT_TIMER:
+                if (-1 != read(timer_fd, &expirations, sizeof(expirations))) {
+                    stats_update();
+                    check_stall();
+                    check_refit();
+                }
+                break;
+            }
+        }
+    }
+
+    if (pipelined) {
+        atomic_store(&quit, 1);
+        stop_stages();
+    }
+
+    close(timer_fd);
+    close(signal_fd);
+    close(epoll_fd);
 }
 
 static void usage(FILE *fp, int argc, char **argv){
@@ -406,26 +1135,97 @@ static void usage(FILE *fp, int argc, char **argv){
         "Options:\n"
         "-d | --device name    Video device name [%s]\n"
         "-j | --threads n      number of threads to use for image processing\n"
+        "-a | --aspect ratio   Terminal cell height / width, 0 stretches the\n"
+        "                      picture to the whole terminal [2]\n"
+        "-r | --raw            Draw with raw escape sequences, one write() per\n"
+        "                      frame, instead of ncurses\n"
+        "-c | --color mode     Draw in colour, two pixels a cell as half\n"
+        "                      blocks: truecolor or 256, implies -r\n"
+        "-B | --braille        Draw 2x4 pixels a cell as braille dots,\n"
+        "                      implies -r\n"
+        "-q | --dither mode    Dither the glyphs: none, ordered (Bayer) or\n"
+        "                      diffusion (Floyd-Steinberg) [none]\n"
+        "-p | --palette name   Glyphs to draw with: ascii, short, long (70\n"
+        "                      levels) or a file holding them on its first\n"
+        "                      line, sparse to dense [ascii]\n"
+        "-g | --gamma value    Gamma of the tone curve, above 1 lightens the\n"
+        "                      mid tones [1]\n"
+        "-b | --buffers n      Number of V4L2 capture buffers [4]\n"
+        "-l | --latest         Only show the newest frame, drop the ones that\n"
+        "                      queued up while the last one was processed\n"
+        "-P | --pipeline       Run capture, processing and drawing on separate\n"
+        "                      threads\n"
+        "-D | --decoders n     Process (and decode) n frames at once on as\n"
+        "                      many threads, implies -P [1, at most 8]\n"
+        "-f | --format name    Capture format: auto, yuyv, uyvy, nv12, grey,\n"
+        "                      rgb24 or mjpeg [auto, uncompressed preferred]\n"
+        "-A | --fit            Capture the smallest frame size covering the\n"
+        "                      terminal, at the rate the drawing keeps up with\n"
+        "-w | --write file     Record the captured frames to file and file.idx\n"
+        "-i | --input file     Replay a recording instead of using a camera\n"
+        "-F | --fast           Replay as fast as possible, not at the recorded\n"
+        "                      timing\n"
+        "-H | --hud            Start with the stats line shown, h toggles it\n"
+        "-S | --stats file     Write the stats to file (or a FIFO) every second\n"
+        "-T | --trace file     Write every frame's timeline as a Chrome trace\n"
+        "-L | --latency        Print a capture to screen latency histogram at\n"
+        "                      exit\n"
+        "-M | --motion level   Only draw when some part of the picture changed\n"
+        "                      by more than level (1-255) on average, and\n"
+        "                      only look a few times a second until then\n"
         "-h | --help           Print this message\n"
         "",
         argv[0],
-        dev_name
+        source_config.device
     );
 }
 
-static const char short_options[] = "d:j:h";
+static const char short_options[] = "d:j:a:rc:Bq:p:g:b:lPD:f:Aw:i:FHS:T:LM:h";
 
 static const struct option long_options[] = {
     { "device",     required_argument, NULL, 'd' },
     { "threads",    required_argument, NULL, 'j' },
+    { "aspect",     required_argument, NULL, 'a' },
+    { "raw",        no_argument,       NULL, 'r' },
+    { "color",      required_argument, NULL, 'c' },
+    { "braille",    no_argument,       NULL, 'B' },
+    { "dither",     required_argument, NULL, 'q' },
+    { "palette",    required_argument, NULL, 'p' },
+    { "gamma",      required_argument, NULL, 'g' },
+    { "buffers",    required_argument, NULL, 'b' },
+    { "latest",     no_argument,       NULL, 'l' },
+    { "pipeline",   no_argument,       NULL, 'P' },
+    { "decoders",   required_argument, NULL, 'D' },
+    { "format",     required_argument, NULL, 'f' },
+    { "fit",        no_argument,       NULL, 'A' },
+    { "write",      required_argument, NULL, 'w' },
+    { "input",      required_argument, NULL, 'i' },
+    { "fast",       no_argument,       NULL, 'F' },
+    { "hud",        no_argument,       NULL, 'H' },
+    { "stats",      required_argument, NULL, 'S' },
+    { "trace",      required_argument, NULL, 'T' },
+    { "latency",    no_argument,       NULL, 'L' },
+    { "motion",     required_argument, NULL, 'M' },
     { "help",       no_argument,       NULL, 'h' },
     { 0,            0,                 0,     0  }
 };
 
 int main(int argc, char **argv){
 
-    dev_name = "/dev/video0";
     int i = 0;
+    double aspect;
+    double gamma;
+    int pixel_aspect = 2 << 16;
+    int braille = 0;
+    char *end;
+    struct stats_snapshot totals;
+
+    /* before any thread is started, they all inherit the mask */
+    sigemptyset(&loop_signals);
+    sigaddset(&loop_signals, SIGINT);
+    sigaddset(&loop_signals, SIGTERM);
+    sigaddset(&loop_signals, SIGWINCH);
+    pthread_sigmask(SIG_BLOCK, &loop_signals, NULL);
 
     for (;;) {
         int idx;
@@ -442,7 +1242,7 @@ int main(int argc, char **argv){
             break;
 
         case 'd':
-            dev_name = optarg;
+            source_config.device = optarg;
             break;
 
         case 'j':
@@ -457,6 +1257,153 @@ int main(int argc, char **argv){
             set_thread_n(atoi(optarg));
             break;
 
+        case 'a':
+            aspect = strtod(optarg, &end);
+            if (end == optarg || *end || aspect < 0 || aspect > 16) {
+                usage(stderr, argc, argv);
+                exit(EXIT_FAILURE);
+            }
+            pixel_aspect = (int)(aspect * (1 << 16));
+            break;
+
+        case 'r':
+            set_raw_output(1);
+            break;
+
+        case 'c':
+            if (!strcmp(optarg, "truecolor")) {
+                colour_mode = COLOUR_TRUE;
+            }
+            else if (!strcmp(optarg, "256")) {
+                colour_mode = COLOUR_256;
+            }
+            else {
+                usage(stderr, argc, argv);
+                exit(EXIT_FAILURE);
+            }
+            set_colour_output(colour_mode);
+            break;
+
+        case 'q':
+            if (!strcmp(optarg, "none")) {
+                dither = DITHER_NONE;
+            }
+            else if (!strcmp(optarg, "ordered")) {
+                dither = DITHER_ORDERED;
+            }
+            else if (!strcmp(optarg, "diffusion")) {
+                dither = DITHER_DIFFUSION;
+            }
+            else {
+                usage(stderr, argc, argv);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'p':
+            if (set_palette(optarg)) {
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'g':
+            gamma = strtod(optarg, &end);
+            if (end == optarg || *end || set_gamma(gamma)) {
+                usage(stderr, argc, argv);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'B':
+            braille = 1;
+            set_braille_output(1);
+            break;
+
+        case 'b':
+            source_config.buffers = strtoul(optarg, &end, 10);
+            if (end == optarg || *end || source_config.buffers < 2 ||
+                source_config.buffers > VIDEO_MAX_FRAME) {
+                usage(stderr, argc, argv);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'l':
+            latest_only = 1;
+            break;
+
+        case 'P':
+            pipelined = 1;
+            break;
+
+        case 'D':
+            n_workers = strtol(optarg, &end, 10);
+            if (end == optarg || *end || n_workers < 1 ||
+                n_workers > MAX_WORKERS) {
+                usage(stderr, argc, argv);
+                exit(EXIT_FAILURE);
+            }
+            pipelined = 1;
+            break;
+
+        case 'f':
+            source_config.pixelformat = source_pixelformat(optarg);
+            if (!source_config.pixelformat && strcmp(optarg, "auto")) {
+                usage(stderr, argc, argv);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'A':
+            source_config.fit = 1;
+            break;
+
+        case 'w':
+            source_config.record = optarg;
+            break;
+
+        case 'i':
+            source = &file_source;
+            source_config.replay = optarg;
+            /* the viewer keeps playing, start over at the end */
+            source_config.loop = 1;
+            break;
+
+        case 'F':
+            source_config.fast = 1;
+            break;
+
+        case 'H':
+            hud_shown = 1;
+            set_hud(hud_line);
+            break;
+
+        case 'S':
+            if (stats_export(optarg)) {
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'T':
+            if (trace_open(optarg)) {
+                exit(EXIT_FAILURE);
+            }
+            latency_report = 1;
+            break;
+
+        case 'L':
+            latency_report = 1;
+            break;
+
+        case 'M':
+            motion_threshold = strtol(optarg, &end, 10);
+            if (end == optarg || *end || motion_threshold < 1 ||
+                motion_threshold > 255) {
+                usage(stderr, argc, argv);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
         case 'h':
             usage(stdout, argc, argv);
             exit(EXIT_SUCCESS);
@@ -467,26 +1414,81 @@ int main(int argc, char **argv){
         }
     }
 
+    /* one buffer for the driver to fill, and for every worker one being
+       processed and the ones waiting on its ring */
+    if (pipelined &&
+        source_config.buffers < n_workers * (CAPTURE_RING_SIZE + 1) + 1) {
+        source_config.buffers = n_workers * (CAPTURE_RING_SIZE + 1) + 1;
+    }
+
+    /* the window isn't up yet, but the terminal already has its size */
+    if (source_config.fit &&
+        get_terminal_xy(&source_config.fit_width, &source_config.fit_height)) {
+        source_config.fit = 0;
+    }
+    if (colour_mode && braille) {
+        fprintf(stderr, "-c and -B don't go together\n");
+        exit(EXIT_FAILURE);
+    }
+    if (colour_mode) {
+        cell_height = 2;
+    }
+    if (braille) {
+        cell_width = 2;
+        cell_height = 4;
+    }
+    source_config.fit_width *= cell_width;
+    source_config.fit_height *= cell_height;
+
+    /* a dithered grid comes with the tone curve applied */
+    set_pretoned(DITHER_NONE != dither && !colour_mode);
+
+    /* a half block is half a cell tall, a braille dot a quarter of it and
+       half as wide */
+    set_pixel_aspect(pixel_aspect * cell_width / cell_height);
+
     struct call_functions{ void (*f)(void) } call_queue[] = {
-        open_device,
-        init_device,
-        start_capturing,
+        source->open,
+        source->init,
+        source->start,
         init_window,
         init_image_processing,
         mainloop,
         uninit_window,
         uninit_image_processing,
-        stop_capturing,
-        uninit_device,
-        close_device
+        source->stop,
+        source->uninit,
+        source->close
     };
 
     for(int i = 0; i < sizeof(call_queue)/sizeof(struct call_functions); i++){
         call_queue[i].f();
     }
 
+    stats_close();
+    trace_close();
+
     fprintf(stderr, "\n");
 
+    /* stale, late and corrupt frames alike, the last happen in every mode */
+    stats_read(&totals);
+    if (latest_only || pipelined || totals.counters[STAT_DROPPED]) {
+        fprintf(stderr, "%llu frames dropped\n",
+            (unsigned long long)totals.counters[STAT_DROPPED]);
+    }
+
+    if (restarts) {
+        fprintf(stderr, "camera stream restarted %lu times\n", restarts);
+    }
+
+    if (refits) {
+        fprintf(stderr, "capture format renegotiated %lu times\n", refits);
+    }
+
+    if (latency_report) {
+        trace_summary(stderr);
+    }
+
     return 0;
 
 }
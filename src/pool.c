@@ -0,0 +1,246 @@
+#include <pthread.h>
+#include "include/pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+
+/* the workers are started once and then parked on a condition variable, every
+ * pool_run() bumps the generation counter to wake them up and waits until all
+ * of them report back, so nothing is allocated per dispatched job
+ */
+struct pool {
+    pthread_t       *tid;
+    int             *index;
+    int             n;          /* workers including the calling thread */
+
+    pthread_mutex_t lock;
+    pthread_cond_t  start;
+    pthread_cond_t  done;
+    unsigned long   generation;
+    unsigned long   base;       /* generation the current workers started at */
+    int             pending;
+    int             quit;
+    pool_job_t      job;
+    void            *arg;
+
+    /* held for the whole run / resize, so the worker set can't change while
+       a job is in flight */
+    pthread_mutex_t dispatch;
+};
+
+static struct pool pool = {
+    .n = 1,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .start = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+    .dispatch = PTHREAD_MUTEX_INITIALIZER
+};
+
+static void *pool_worker(void *arg){
+
+    int index = *(int*)arg;
+    unsigned long seen;
+    pool_job_t job;
+    void *job_arg;
+    int count;
+
+    pthread_mutex_lock(&pool.lock);
+    /* not pool.generation, a run may already have been posted by the time
+       this thread gets the lock */
+    seen = pool.base;
+
+    for (;;) {
+        while (pool.generation == seen && !pool.quit) {
+            pthread_cond_wait(&pool.start, &pool.lock);
+        }
+
+        if (pool.quit) {
+            break;
+        }
+
+        seen = pool.generation;
+        job = pool.job;
+        job_arg = pool.arg;
+        count = pool.n;
+        pthread_mutex_unlock(&pool.lock);
+
+        job(job_arg, index, count);
+
+        pthread_mutex_lock(&pool.lock);
+        if (0 == --pool.pending) {
+            pthread_cond_signal(&pool.done);
+        }
+    }
+
+    pthread_mutex_unlock(&pool.lock);
+
+    return NULL;
+}
+
+/* must be called with the dispatch lock held */
+static void pool_stop(void){
+
+    int i;
+
+    pthread_mutex_lock(&pool.lock);
+    pool.quit = 1;
+    pthread_cond_broadcast(&pool.start);
+    pthread_mutex_unlock(&pool.lock);
+
+    for (i = 0; i < pool.n - 1; i++) {
+        pthread_join(pool.tid[i], NULL);
+    }
+
+    free(pool.tid);
+    free(pool.index);
+    pool.tid = NULL;
+    pool.index = NULL;
+    pool.n = 1;
+    pool.quit = 0;
+}
+
+/* must be called with the dispatch lock held */
+static int pool_start(int n){
+
+    int i;
+
+    if (n < 2) {
+        return 0;
+    }
+
+    pool.tid = (pthread_t*)malloc(sizeof(pthread_t) * (n - 1));
+    pool.index = (int*)malloc(sizeof(int) * (n - 1));
+
+    if (!pool.tid || !pool.index) {
+        fprintf(stderr, "pool: out of memory\n");
+        free(pool.tid);
+        free(pool.index);
+        pool.tid = NULL;
+        pool.index = NULL;
+        return 1;
+    }
+
+    pool.base = pool.generation;
+
+    for (i = 0; i < n - 1; i++) {
+        pool.index[i] = i + 1;
+        if (0 != pthread_create(pool.tid + i, NULL, pool_worker,
+                                (void*)(pool.index + i))) {
+            fprintf(stderr, "pool: failed to start worker %d\n", i + 1);
+            break;
+        }
+        /* count workers as they come up so pool_stop() can join them */
+        pool.n = i + 2;
+    }
+
+    return i != n - 1;
+}
+
+int pool_init(int n){
+    return pool_resize(n);
+}
+
+void pool_uninit(void){
+    pthread_mutex_lock(&pool.dispatch);
+    pool_stop();
+    pthread_mutex_unlock(&pool.dispatch);
+}
+
+int pool_resize(int n){
+
+    int ret = 0;
+
+    if (n < 1) {
+        n = 1;
+    }
+
+    pthread_mutex_lock(&pool.dispatch);
+    if (n != pool.n) {
+        pool_stop();
+        ret = pool_start(n);
+    }
+    pthread_mutex_unlock(&pool.dispatch);
+
+    return ret;
+}
+
+int pool_size(void){
+    return pool.n;
+}
+
+void pool_run(pool_job_t job, void *arg){
+
+    /* the workers are busy with another thread's job, several decoder
+       threads resize at once, rather than queue up behind it this one does
+       the whole job itself */
+    if (pthread_mutex_trylock(&pool.dispatch)) {
+        job(arg, 0, 1);
+        return;
+    }
+
+    if (pool.n < 2) {
+        job(arg, 0, 1);
+        pthread_mutex_unlock(&pool.dispatch);
+        return;
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.job = job;
+    pool.arg = arg;
+    pool.pending = pool.n - 1;
+    pool.generation++;
+    pthread_cond_broadcast(&pool.start);
+    pthread_mutex_unlock(&pool.lock);
+
+    job(arg, 0, pool.n);
+
+    pthread_mutex_lock(&pool.lock);
+    while (pool.pending) {
+        pthread_cond_wait(&pool.done, &pool.lock);
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    pthread_mutex_unlock(&pool.dispatch);
+}
+
+/* tiles are handed out through a shared counter, so a worker that finishes
+   early keeps taking tiles instead of idling on a fixed stripe */
+struct pool_tiles {
+    pool_tile_t job;
+    void        *arg;
+    int         n_tiles;
+    atomic_int  next;
+};
+
+static void pool_tile_worker(void *arg, int index, int count){
+
+    struct pool_tiles *tiles = (struct pool_tiles*)arg;
+    int tile;
+
+    while ((tile = atomic_fetch_add_explicit(
+                &tiles->next, 1, memory_order_relaxed)) < tiles->n_tiles) {
+        tiles->job(tiles->arg, tile);
+    }
+}
+
+void pool_run_tiles(pool_tile_t job, void *arg, int n_tiles){
+
+    struct pool_tiles tiles;
+
+    tiles.job = job;
+    tiles.arg = arg;
+    tiles.n_tiles = n_tiles;
+    atomic_init(&tiles.next, 0);
+
+    pool_run(pool_tile_worker, &tiles);
+}
+
+void pool_stripe(int total, int index, int count, int *start, int *length){
+
+    int base = total / count;
+    int rest = total % count;
+
+    /* the first `rest` stripes get one extra row */
+    *start = base * index + (index < rest ? index : rest);
+    *length = base + (index < rest);
+}
@@ -0,0 +1,322 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+
+#include "include/source.h"
+
+/* frames are handed out as pointers into the mapped recording, the slots
+   only mimic the driver's buffers so the rest of the program can't tell the
+   difference, a frame's slot is busy until it's put back, there are as
+   many as buffers were asked for */
+
+struct replay_entry {
+    size_t      offset;
+    size_t      size;
+    uint64_t    timestamp;  /* ns since the first frame */
+};
+
+static uint8_t              *data;
+static size_t               data_size;
+static struct replay_entry  *entries;
+static size_t               n_entries;
+static size_t               next;
+static struct frame_format  replay_format;
+static atomic_int           *in_use;
+static unsigned int         n_slots;
+
+/* CLOCK_MONOTONIC time the first frame of the current pass is due */
+static uint64_t             base;
+
+/* expires when the next frame is due, it's what callers poll on */
+static int                  timer_fd = -1;
+
+static uint64_t now_ns(void){
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void read_index(const char *name){
+
+    FILE *f;
+    char fourcc[5];
+    unsigned long long offset, size, timestamp;
+    size_t capacity = 0;
+    struct replay_entry *grown;
+
+    f = fopen(name, "r");
+    if (!f) {
+        fprintf(stderr, "Cannot open '%s': %d, %s\n",
+             name, errno, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if (4 != fscanf(f, "%4s %d %d %d", fourcc, &replay_format.width,
+                    &replay_format.height, &replay_format.stride) ||
+        4 != strlen(fourcc)) {
+        fprintf(stderr, "%s: bad header\n", name);
+        exit(EXIT_FAILURE);
+    }
+
+    replay_format.pixelformat = fourcc[0] | fourcc[1] << 8 |
+                                fourcc[2] << 16 | (uint32_t)fourcc[3] << 24;
+
+    while (3 == fscanf(f, "%llu %llu %llu", &offset, &size, &timestamp)) {
+        if (offset + size > data_size) {
+            fprintf(stderr, "%s: frame %zu is past the end of the data\n",
+                 name, n_entries);
+            exit(EXIT_FAILURE);
+        }
+
+        if (n_entries == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            grown = realloc(entries, capacity * sizeof(*entries));
+            if (!grown) {
+                fprintf(stderr, "Out of memory\n");
+                exit(EXIT_FAILURE);
+            }
+            entries = grown;
+        }
+
+        entries[n_entries].offset = offset;
+        entries[n_entries].size = size;
+        entries[n_entries].timestamp = timestamp;
+        n_entries++;
+    }
+
+    fclose(f);
+
+    if (!n_entries) {
+        fprintf(stderr, "%s: no frames\n", name);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void open_replay(void){
+
+    struct stat st;
+    char *index_name;
+    int fd;
+
+    fd = open(source_config.replay, O_RDONLY);
+
+    if (-1 == fd || -1 == fstat(fd, &st)) {
+        fprintf(stderr, "Cannot open '%s': %d, %s\n",
+             source_config.replay, errno, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    data_size = st.st_size;
+    data = mmap(NULL, data_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if (MAP_FAILED == data) {
+        fprintf(stderr, "Cannot map '%s': %d, %s\n",
+             source_config.replay, errno, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    /* the mapping stays valid without the descriptor */
+    close(fd);
+
+    index_name = malloc(strlen(source_config.replay) +
+                        sizeof(RECORDING_INDEX_SUFFIX));
+    if (!index_name) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    strcpy(index_name, source_config.replay);
+    strcat(index_name, RECORDING_INDEX_SUFFIX);
+
+    read_index(index_name);
+    free(index_name);
+
+    n_slots = source_config.buffers;
+    in_use = calloc(n_slots, sizeof(*in_use));
+    if (!in_use) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (-1 == timer_fd) {
+        fprintf(stderr, "timerfd_create error %d, %s\n",
+             errno, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+static uint64_t due(size_t i){
+    return base + entries[i].timestamp;
+}
+
+/* make the timer fd readable when the next frame is due, right away when
+   there's no waiting to be done */
+static void arm_timer(int now){
+
+    struct itimerspec its;
+    int flags = 0;
+
+    memset(&its, 0, sizeof(its));
+
+    if (now || next == n_entries || source_config.fast) {
+        its.it_value.tv_nsec = 1;
+    }
+    else {
+        its.it_value.tv_sec = due(next) / 1000000000u;
+        its.it_value.tv_nsec = due(next) % 1000000000u;
+        flags = TFD_TIMER_ABSTIME;
+    }
+
+    timerfd_settime(timer_fd, flags, &its, NULL);
+}
+
+static void init_replay(void){
+}
+
+static void start_replay(void){
+    next = 0;
+    base = now_ns();
+    arm_timer(0);
+}
+
+static void stop_replay(void){
+}
+
+static void uninit_replay(void){
+}
+
+static void close_replay(void){
+    close(timer_fd);
+    timer_fd = -1;
+    munmap(data, data_size);
+    free(entries);
+    entries = NULL;
+    n_entries = 0;
+    free(in_use);
+    in_use = NULL;
+    n_slots = 0;
+}
+
+static int replay_fd(void){
+    return timer_fd;
+}
+
+static int wait_replay(int timeout_ms){
+
+    uint64_t now;
+    uint64_t left;
+    uint64_t expirations;
+    struct timespec ts;
+
+    /* the timer goes quiet until it's armed again */
+    if (-1 == read(timer_fd, &expirations, sizeof(expirations)) &&
+        EAGAIN != errno) {
+        fprintf(stderr, "timerfd read error %d, %s\n", errno, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if (next == n_entries) {
+        if (!source_config.loop) {
+            return -1;
+        }
+        start_replay();
+    }
+
+    /* like a device, stay readable until the frame is taken */
+    now = now_ns();
+    if (source_config.fast || now >= due(next)) {
+        arm_timer(1);
+        return 1;
+    }
+
+    left = due(next) - now;
+    if (left > (uint64_t)timeout_ms * 1000000u) {
+        left = (uint64_t)timeout_ms * 1000000u;
+    }
+
+    ts.tv_sec = left / 1000000000u;
+    ts.tv_nsec = left % 1000000000u;
+    while (-1 == nanosleep(&ts, &ts) && EINTR == errno);
+
+    if (now_ns() >= due(next)) {
+        arm_timer(1);
+        return 1;
+    }
+
+    return 0;
+}
+
+static int get_replay(struct frame *frame){
+
+    int expected;
+
+    if (next == n_entries) {
+        return 0;
+    }
+
+    if (!source_config.fast && now_ns() < due(next)) {
+        return 0;
+    }
+
+    for (unsigned int i = 0; i < n_slots; i++) {
+        expected = 0;
+        if (atomic_compare_exchange_strong(&in_use[i], &expected, 1)) {
+            frame->data = data + entries[next].offset;
+            frame->size = entries[next].size;
+            frame->index = i;
+            /* as if it had just been captured */
+            frame->timestamp = source_config.fast ? now_ns() : due(next);
+            next++;
+            arm_timer(0);
+            return 1;
+        }
+    }
+
+    /* every slot is still being processed, like a driver out of buffers */
+    return 0;
+}
+
+static void put_replay(struct frame *frame){
+    atomic_store(&in_use[frame->index], 0);
+}
+
+static void format_replay(struct frame_format *fmt){
+    *fmt = replay_format;
+}
+
+static unsigned int n_buffers_replay(void){
+    return n_slots;
+}
+
+/* a recording comes in the one format it was made in */
+static int refit_replay(void){
+    return 0;
+}
+
+const struct frame_source file_source = {
+    open_replay,
+    init_replay,
+    start_replay,
+    stop_replay,
+    uninit_replay,
+    close_replay,
+    replay_fd,
+    wait_replay,
+    get_replay,
+    put_replay,
+    format_replay,
+    n_buffers_replay,
+    refit_replay
+};
@@ -0,0 +1,116 @@
+#include "include/ring.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+int ring_init(struct ring *ring, unsigned int capacity){
+
+    unsigned int size = 1;
+
+    /* round up to a power of two so the index wraps with a mask */
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    ring->slots = (atomic_uint*)calloc(size, sizeof(atomic_uint));
+    if (!ring->slots) {
+        fprintf(stderr, "ring: out of memory\n");
+        return 1;
+    }
+
+    ring->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (-1 == ring->event_fd) {
+        fprintf(stderr, "ring: eventfd failed\n");
+        free(ring->slots);
+        return 1;
+    }
+
+    ring->mask = size - 1;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+
+    return 0;
+}
+
+void ring_uninit(struct ring *ring){
+    close(ring->event_fd);
+    free(ring->slots);
+    ring->slots = NULL;
+}
+
+int ring_push(struct ring *ring, unsigned int value, unsigned int *dropped){
+
+    unsigned long head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    unsigned long tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    uint64_t one = 1;
+    int ret = 0;
+
+    if (head - tail > ring->mask) {
+        /* full, take the oldest entry out unless the consumer beats us to it,
+           whoever moves the tail owns the entry */
+        *dropped = atomic_load_explicit(
+            &ring->slots[tail & ring->mask], memory_order_relaxed);
+        ret = atomic_compare_exchange_strong_explicit(
+            &ring->tail, &tail, tail + 1,
+            memory_order_acq_rel, memory_order_acquire);
+    }
+
+    atomic_store_explicit(
+        &ring->slots[head & ring->mask], value, memory_order_relaxed);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+    /* the counter only wakes the consumer up, its value doesn't matter */
+    if (-1 == write(ring->event_fd, &one, sizeof(one)) && EAGAIN != errno) {
+        fprintf(stderr, "ring: eventfd write failed\n");
+    }
+
+    return ret;
+}
+
+int ring_pop(struct ring *ring, unsigned int *value){
+
+    unsigned long tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    unsigned long head;
+
+    for (;;) {
+        head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        if (tail == head) {
+            return 0;
+        }
+
+        *value = atomic_load_explicit(
+            &ring->slots[tail & ring->mask], memory_order_relaxed);
+
+        /* a failed exchange means the producer dropped this entry, tail is
+           reloaded and we go again */
+        if (atomic_compare_exchange_weak_explicit(
+                &ring->tail, &tail, tail + 1,
+                memory_order_acq_rel, memory_order_acquire)) {
+            return 1;
+        }
+    }
+}
+
+int ring_wait(struct ring *ring, int timeout_ms){
+
+    struct pollfd pfd;
+    uint64_t count;
+    int r;
+
+    pfd.fd = ring->event_fd;
+    pfd.events = POLLIN;
+
+    r = poll(&pfd, 1, timeout_ms);
+    if (r > 0) {
+        /* reset the counter, pops find out how much there really is */
+        if (-1 == read(ring->event_fd, &count, sizeof(count))) {
+            return 0;
+        }
+    }
+
+    return r > 0;
+}
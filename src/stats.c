@@ -0,0 +1,243 @@
+#include "include/stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <signal.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/* threads that can get a block of their own at once, the capture, decoder
+   and render ones with room to spare, any more don't count */
+#define MAX_STAT_THREADS 16
+
+/* rates are averaged over this long */
+#define STATS_PERIOD_NS 1000000000u
+
+/* one writer per block, the readers only ever see whole 64 bit values, so
+   relaxed loads and stores are all it takes */
+struct stat_block {
+    _Alignas(64) atomic_uint_least64_t counters[N_STAT_COUNTERS];
+    atomic_uint_least64_t stage_ns[N_STAT_STAGES];
+    atomic_uint_least64_t stage_calls[N_STAT_STAGES];
+};
+
+static struct stat_block    blocks[MAX_STAT_THREADS];
+static atomic_int           taken[MAX_STAT_THREADS];
+static atomic_int           n_blocks;   /* ever taken, readers sum these */
+static _Thread_local struct stat_block *local;
+static _Thread_local int    unregistered = 1;
+
+/* render thread only */
+static struct stats_snapshot last;
+static uint64_t             last_time;
+static char                 rates[128];
+static const char           *export_path;
+static int                  export_fd = -1;
+
+uint64_t stats_now(void){
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static struct stat_block *get_block(void){
+
+    int expected;
+    int n;
+
+    if (unregistered) {
+        unregistered = 0;
+        local = NULL;
+
+        /* a block given up by a thread that's gone keeps its totals, the new
+           owner adds on to them */
+        for (int i = 0; i < MAX_STAT_THREADS && !local; i++) {
+            expected = 0;
+            if (atomic_compare_exchange_strong(&taken[i], &expected, 1)) {
+                local = &blocks[i];
+                n = atomic_load(&n_blocks);
+                while (n <= i &&
+                       !atomic_compare_exchange_weak(&n_blocks, &n, i + 1));
+            }
+        }
+    }
+
+    return local;
+}
+
+void stats_release(void){
+
+    if (local) {
+        atomic_store(&taken[local - blocks], 0);
+    }
+    local = NULL;
+    unregistered = 1;
+}
+
+static void add(atomic_uint_least64_t *v, uint64_t n){
+    atomic_store_explicit(
+        v, atomic_load_explicit(v, memory_order_relaxed) + n,
+        memory_order_relaxed);
+}
+
+void stats_count(enum stat_counter counter, uint64_t n){
+
+    struct stat_block *b = get_block();
+
+    if (b) {
+        add(&b->counters[counter], n);
+    }
+}
+
+void stats_time(enum stat_stage stage, uint64_t start){
+
+    struct stat_block *b = get_block();
+
+    if (b) {
+        add(&b->stage_ns[stage], stats_now() - start);
+        add(&b->stage_calls[stage], 1);
+    }
+}
+
+void stats_read(struct stats_snapshot *snapshot){
+
+    int n = atomic_load(&n_blocks);
+
+    memset(snapshot, 0, sizeof(*snapshot));
+
+    for (int i = 0; i < n; i++) {
+        for (int c = 0; c < N_STAT_COUNTERS; c++) {
+            snapshot->counters[c] += atomic_load_explicit(
+                &blocks[i].counters[c], memory_order_relaxed);
+        }
+        for (int s = 0; s < N_STAT_STAGES; s++) {
+            snapshot->stage_ns[s] += atomic_load_explicit(
+                &blocks[i].stage_ns[s], memory_order_relaxed);
+            snapshot->stage_calls[s] += atomic_load_explicit(
+                &blocks[i].stage_calls[s], memory_order_relaxed);
+        }
+    }
+}
+
+/* a FIFO without a reader can't be opened yet, that's retried every period,
+   returns 1 on any other error */
+static int open_export(void){
+
+    export_fd = open(export_path, O_WRONLY | O_CREAT | O_TRUNC | O_NONBLOCK |
+                     O_CLOEXEC, 0644);
+
+    if (-1 == export_fd && ENXIO != errno) {
+        fprintf(stderr, "Cannot open '%s': %d, %s\n",
+             export_path, errno, strerror(errno));
+        return 1;
+    }
+
+    return 0;
+}
+
+int stats_export(const char *path){
+
+    export_path = path;
+
+    /* a reader going away shows up as EPIPE instead of killing us */
+    signal(SIGPIPE, SIG_IGN);
+
+    return open_export();
+}
+
+static double stage_ms(struct stats_snapshot *now, int stage){
+
+    uint64_t calls = now->stage_calls[stage] - last.stage_calls[stage];
+
+    if (!calls) {
+        return 0;
+    }
+
+    return (now->stage_ns[stage] - last.stage_ns[stage]) / 1e6 / calls;
+}
+
+static void write_export(const char *line, size_t n){
+
+    if (-1 == export_fd && (open_export() || -1 == export_fd)) {
+        return;
+    }
+
+    /* a full FIFO loses the line, the next one has fresher numbers */
+    if (-1 == write(export_fd, line, n) && EAGAIN != errno) {
+        close(export_fd);
+        export_fd = -1;
+    }
+}
+
+void stats_update(void){
+
+    struct stats_snapshot now;
+    uint64_t t = stats_now();
+    double seconds;
+    double capture_fps, render_fps;
+    double ms[N_STAT_STAGES];
+    unsigned long long dropped;
+    unsigned long long idle;
+    char line[256];
+    int n;
+
+    if (!last_time) {
+        last_time = t;
+        stats_read(&last);
+        return;
+    }
+
+    if (t - last_time < STATS_PERIOD_NS) {
+        return;
+    }
+
+    stats_read(&now);
+    seconds = (t - last_time) / 1e9;
+
+    capture_fps = (now.counters[STAT_CAPTURED] - last.counters[STAT_CAPTURED]) /
+                  seconds;
+    render_fps = (now.counters[STAT_RENDERED] - last.counters[STAT_RENDERED]) /
+                 seconds;
+    dropped = now.counters[STAT_DROPPED];
+    idle = now.counters[STAT_IDLE];
+    for (int s = 0; s < N_STAT_STAGES; s++) {
+        ms[s] = stage_ms(&now, s);
+    }
+
+    snprintf(rates, sizeof(rates),
+        "cap %.1f fps  out %.1f fps  drop %llu  idle %llu  "
+        "decode %.2f  resize %.2f  draw %.2f ms",
+        capture_fps, render_fps, dropped, idle,
+        ms[STAT_DECODE], ms[STAT_RESIZE], ms[STAT_DRAW]
+    );
+
+    if (export_path) {
+        n = snprintf(line, sizeof(line),
+            "time=%.3f capture_fps=%.2f render_fps=%.2f dropped=%llu "
+            "idle=%llu decode_ms=%.3f resize_ms=%.3f draw_ms=%.3f\n",
+            t / 1e9, capture_fps, render_fps, dropped, idle,
+            ms[STAT_DECODE], ms[STAT_RESIZE], ms[STAT_DRAW]
+        );
+        write_export(line, n);
+    }
+
+    last = now;
+    last_time = t;
+}
+
+void stats_format(char *line, size_t size){
+    snprintf(line, size, "%s", rates[0] ? rates : "measuring...");
+}
+
+void stats_close(void){
+    if (-1 != export_fd) {
+        close(export_fd);
+        export_fd = -1;
+    }
+}
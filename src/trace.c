@@ -0,0 +1,195 @@
+#include "include/trace.h"
+#include "include/stats.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+/* latencies are binned at this resolution up to TRACE_BINS of them, the
+   last bin takes everything slower */
+#define TRACE_BIN_NS    100000u     /* 0.1 ms */
+#define TRACE_BINS      10000       /* 1 s */
+
+/* frames kept for the trace file, over half an hour at 30 fps */
+#define TRACE_MAX_FRAMES 65536
+
+static unsigned long        next_id;
+
+/* render thread only */
+static uint32_t             bins[TRACE_BINS];
+static unsigned long        n_frames;
+static uint64_t             slowest;
+
+static const char           *trace_path;
+static struct frame_trace   *frames;
+static unsigned long        n_kept;
+
+void trace_dequeued(struct frame_trace *trace, uint64_t capture){
+
+    trace->id = next_id++;
+    trace->dequeue = stats_now();
+
+    /* a timestamp from another clock or the future would only confuse
+       the numbers, the dequeue is the next best thing */
+    trace->capture = capture && capture <= trace->dequeue ?
+                     capture : trace->dequeue;
+}
+
+void trace_written(struct frame_trace *trace){
+
+    uint64_t latency;
+    uint64_t bin;
+
+    trace->written = stats_now();
+    latency = trace->written - trace->capture;
+
+    bin = latency / TRACE_BIN_NS;
+    bins[bin < TRACE_BINS ? bin : TRACE_BINS - 1]++;
+    n_frames++;
+    if (latency > slowest) {
+        slowest = latency;
+    }
+
+    if (frames && n_kept < TRACE_MAX_FRAMES) {
+        frames[n_kept++] = *trace;
+    }
+}
+
+int trace_open(const char *path){
+
+    frames = (struct frame_trace*)malloc(
+        TRACE_MAX_FRAMES * sizeof(*frames));
+
+    if (!frames) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    trace_path = path;
+
+    return 0;
+}
+
+/* one complete ("X") event, times in us as the format wants them */
+static void write_event(
+    FILE *fp,
+    const char *name,
+    int tid,
+    unsigned long id,
+    uint64_t start,
+    uint64_t end,
+    uint64_t origin
+){
+    fprintf(fp,
+        ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, "
+        "\"ts\": %.3f, \"dur\": %.3f, \"args\": {\"frame\": %lu}}",
+        name, tid, (start - origin) / 1e3, (end - start) / 1e3, id);
+}
+
+void trace_close(void){
+
+    FILE *fp;
+    struct frame_trace *t;
+    uint64_t origin;
+
+    if (!frames) {
+        return;
+    }
+
+    fp = fopen(trace_path, "w");
+    if (!fp) {
+        fprintf(stderr, "Cannot create '%s': %d, %s\n",
+             trace_path, errno, strerror(errno));
+        free(frames);
+        frames = NULL;
+        return;
+    }
+
+    origin = n_kept ? frames[0].capture : 0;
+
+    /* a lane per stage: the camera, the processing and the terminal */
+    fprintf(fp, "{\"traceEvents\": [\n"
+        "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 1, "
+        "\"args\": {\"name\": \"capture\"}},\n"
+        "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 2, "
+        "\"args\": {\"name\": \"process\"}},\n"
+        "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 3, "
+        "\"args\": {\"name\": \"render\"}}");
+
+    for (unsigned long i = 0; i < n_kept; i++) {
+        t = &frames[i];
+        if (t->capture < origin) {
+            continue;
+        }
+        write_event(fp, "capture", 1, t->id, t->capture, t->dequeue, origin);
+        write_event(fp, "decode", 2, t->id, t->dequeue, t->decoded, origin);
+        write_event(fp, "resize", 2, t->id, t->decoded, t->resized, origin);
+        write_event(fp, "draw", 3, t->id, t->resized, t->written, origin);
+    }
+
+    fprintf(fp, "\n],\n\"displayTimeUnit\": \"ms\"}\n");
+    fclose(fp);
+
+    free(frames);
+    frames = NULL;
+}
+
+/* latency under which p percent of the frames were shown, in ms */
+static double percentile(int p){
+
+    unsigned long rank = (n_frames * p + 99) / 100;
+    unsigned long seen = 0;
+
+    for (int i = 0; i < TRACE_BINS; i++) {
+        seen += bins[i];
+        if (seen >= rank) {
+            return (i + 1) * TRACE_BIN_NS / 1e6;
+        }
+    }
+
+    return slowest / 1e6;
+}
+
+void trace_summary(FILE *fp){
+
+    unsigned long count;
+    unsigned long most = 0;
+    unsigned long counts[16];
+    int lo, hi;
+    int n = 0;
+
+    if (!n_frames) {
+        fprintf(fp, "no frames were shown\n");
+        return;
+    }
+
+    fprintf(fp,
+        "capture to tty latency of %lu frames\n"
+        "p50 %.1f ms  p90 %.1f ms  p99 %.1f ms  max %.1f ms\n",
+        n_frames, percentile(50), percentile(90), percentile(99),
+        slowest / 1e6);
+
+    /* doubling buckets from 1 ms up, the first one holds everything faster */
+    for (lo = 0, hi = 10; lo < TRACE_BINS && n < 16; lo = hi, hi *= 2) {
+        count = 0;
+        for (int i = lo; i < hi && i < TRACE_BINS; i++) {
+            count += bins[i];
+        }
+        counts[n++] = count;
+        if (count > most) {
+            most = count;
+        }
+    }
+
+    lo = 0;
+    hi = 1;
+    for (int i = 0; i < n; i++, lo = hi, hi *= 2) {
+        if (!counts[i]) {
+            continue;
+        }
+        fprintf(fp, "%5d - %-5d ms %8lu ", lo, hi, counts[i]);
+        for (unsigned long j = 0; j < counts[i] * 40 / most; j++) {
+            fputc('#', fp);
+        }
+        fputc('\n', fp);
+    }
+}
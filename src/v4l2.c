@@ -0,0 +1,821 @@
+/*
+ * V4L2 capture, based on the example from the linux kernel documentation
+ * https://www.kernel.org/doc/html/v4.9/media/uapi/v4l/capture.c.html
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/select.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+
+#include <linux/videodev2.h>
+
+#include "include/source.h"
+
+#define CLEAR(x) memset(&(x), 0, sizeof(x))
+
+struct buffer {
+    void   *start;
+    size_t  length;
+};
+
+static int              fd = -1;
+static struct buffer    *buffers;
+static unsigned int     n_buffers;
+static struct v4l2_buffer *dequeued;   /* last dequeue of each buffer */
+
+static struct v4l2_pix_format capture_format;
+
+/* fit mode, the size the driver started out with sets the aspect of stepwise
+   sizes and the last size and interval asked for are what refits compare
+   against, drivers are free to round them */
+static uint32_t         native_width;
+static uint32_t         native_height;
+static struct v4l2_pix_format fitted;
+static struct v4l2_fract fitted_interval;
+
+/* capture formats we can handle, in the order they're preferred when the
+   format is picked automatically, anything uncompressed beats MJPEG */
+static const struct {
+    const char  *name;
+    uint32_t    pixelformat;
+    int         depth;          /* bytes per pixel of the first plane */
+} formats[] = {
+    { "yuyv",   V4L2_PIX_FMT_YUYV,  2 },
+    { "uyvy",   V4L2_PIX_FMT_UYVY,  2 },
+    { "nv12",   V4L2_PIX_FMT_NV12,  1 },
+    { "grey",   V4L2_PIX_FMT_GREY,  1 },
+    { "rgb24",  V4L2_PIX_FMT_RGB24, 3 },
+    { "mjpeg",  V4L2_PIX_FMT_MJPEG, 0 }
+};
+
+#define N_FORMATS (sizeof(formats)/sizeof(*formats))
+
+struct source_config source_config = {
+    .device = "/dev/video0",
+    .buffers = 4
+};
+
+/* recording of the captured frames, if one was asked for */
+static FILE             *record_data;
+static FILE             *record_index;
+static size_t           record_offset;
+static uint64_t         record_start;
+static unsigned long    record_frames;
+
+static void errno_exit(const char *s){
+    fprintf(stderr, "%s error %d, %s\n", s, errno, strerror(errno));
+    exit(EXIT_FAILURE);
+}
+
+static int xioctl(int fh, int request, void *arg){
+
+    int r;
+
+    do {
+        r = ioctl(fh, request, arg);
+    } while (-1 == r && EINTR == errno);
+
+    return r;
+}
+
+uint32_t source_pixelformat(const char *name){
+
+    for (int i = 0; i < N_FORMATS; i++) {
+        if (0 == strcmp(name, formats[i].name)) {
+            return formats[i].pixelformat;
+        }
+    }
+
+    return 0;
+}
+
+static void stop_capturing(void){
+
+    enum v4l2_buf_type type;
+
+    type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (-1 == xioctl(fd, VIDIOC_STREAMOFF, &type)){
+        errno_exit("VIDIOC_STREAMOFF");
+    }
+}
+
+static void start_capturing(void){
+
+    unsigned int i;
+    enum v4l2_buf_type type;
+
+    for (i = 0; i < n_buffers; ++i) {
+        struct v4l2_buffer buf;
+
+        CLEAR(buf);
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_MMAP;
+        buf.index = i;
+
+        if (-1 == xioctl(fd, VIDIOC_QBUF, &buf))
+        errno_exit("VIDIOC_QBUF");
+    }
+    type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (-1 == xioctl(fd, VIDIOC_STREAMON, &type)){
+        errno_exit("VIDIOC_STREAMON");
+    }
+}
+
+static void uninit_device(void){
+
+    unsigned int i;
+
+    for (i = 0; i < n_buffers; ++i){
+        if (-1 == munmap(buffers[i].start, buffers[i].length)){
+            errno_exit("munmap");
+        }
+    }
+    free(buffers);
+    free(dequeued);
+}
+
+static void init_mmap(void){
+
+    struct v4l2_requestbuffers req;
+
+    CLEAR(req);
+
+    req.count = source_config.buffers;
+    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = V4L2_MEMORY_MMAP;
+
+    if (-1 == xioctl(fd, VIDIOC_REQBUFS, &req)) {
+        if (EINVAL == errno) {
+            fprintf(stderr, "%s does not support "
+            "memory mappingn", source_config.device);
+            exit(EXIT_FAILURE);
+        }
+        else {
+            errno_exit("VIDIOC_REQBUFS");
+        }
+    }
+
+    if (req.count < 2) {
+        fprintf(
+            stderr,
+            "Insufficient buffer memory on %s\n",
+            source_config.device
+        );
+        exit(EXIT_FAILURE);
+    }
+
+    buffers = calloc(req.count, sizeof(*buffers));
+    dequeued = calloc(req.count, sizeof(*dequeued));
+
+    if (!buffers || !dequeued) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (n_buffers = 0; n_buffers < req.count; ++n_buffers) {
+        struct v4l2_buffer buf;
+
+        CLEAR(buf);
+
+        buf.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_MMAP;
+        buf.index  = n_buffers;
+
+        if (-1 == xioctl(fd, VIDIOC_QUERYBUF, &buf)){
+            errno_exit("VIDIOC_QUERYBUF");
+        }
+
+        buffers[n_buffers].length = buf.length;
+        buffers[n_buffers].start =
+        mmap(NULL /* start anywhere */,
+              buf.length,
+            PROT_READ | PROT_WRITE /* required */,
+            MAP_SHARED /* recommended */,
+            fd, buf.m.offset\
+        );
+
+        if (MAP_FAILED == buffers[n_buffers].start)
+            errno_exit("mmap");
+        }
+}
+
+/* walk VIDIOC_ENUM_FMT and return the index in formats[] to capture in */
+static int pick_format(void){
+
+    struct v4l2_fmtdesc desc;
+    int supported[N_FORMATS] = {0};
+    int i;
+
+    CLEAR(desc);
+    desc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    while (0 == xioctl(fd, VIDIOC_ENUM_FMT, &desc)) {
+        for (i = 0; i < N_FORMATS; i++) {
+            if (formats[i].pixelformat == desc.pixelformat) {
+                supported[i] = 1;
+            }
+        }
+        desc.index++;
+    }
+
+    for (i = 0; i < N_FORMATS; i++) {
+        if (source_config.pixelformat == formats[i].pixelformat) {
+            if (!supported[i]) {
+                fprintf(stderr, "%s can't capture %s\n",
+                     source_config.device, formats[i].name);
+                exit(EXIT_FAILURE);
+            }
+            return i;
+        }
+    }
+
+    for (i = 0; i < N_FORMATS; i++) {
+        if (supported[i]) {
+            return i;
+        }
+    }
+
+    fprintf(stderr, "%s has no supported capture format\n", source_config.device);
+    exit(EXIT_FAILURE);
+}
+
+/* keep the current frame size if the new format offers it, otherwise take the
+   discrete size closest to it, stepwise sizes are left to the driver */
+static void pick_frame_size(uint32_t pixelformat, struct v4l2_pix_format *pix){
+
+    struct v4l2_frmsizeenum size;
+    long area = (long)pix->width * pix->height;
+    long best = -1;
+    long diff;
+    uint32_t width = pix->width;
+    uint32_t height = pix->height;
+
+    CLEAR(size);
+    size.pixel_format = pixelformat;
+
+    while (0 == xioctl(fd, VIDIOC_ENUM_FRAMESIZES, &size)) {
+        if (V4L2_FRMSIZE_TYPE_DISCRETE != size.type) {
+            return;
+        }
+
+        diff = labs((long)size.discrete.width * size.discrete.height - area);
+        if (-1 == best || diff < best) {
+            best = diff;
+            width = size.discrete.width;
+            height = size.discrete.height;
+        }
+
+        if (size.discrete.width == pix->width &&
+            size.discrete.height == pix->height) {
+            return;
+        }
+        size.index++;
+    }
+
+    pix->width = width;
+    pix->height = height;
+}
+
+/* smallest v not under want on the min + n * step ladder, clamped to max */
+static uint32_t step_up(uint32_t want, uint32_t min, uint32_t max,
+                        uint32_t step){
+
+    if (want <= min) {
+        return min;
+    }
+
+    if (step > 1) {
+        want = min + (want - min + step - 1) / step * step;
+    }
+
+    return want < max ? want : max;
+}
+
+/* a stepwise size with the driver's default aspect, just covering the grid */
+static void fit_stepwise_size(const struct v4l2_frmsize_stepwise *sw,
+                              struct v4l2_pix_format *pix){
+
+    uint64_t w = source_config.fit_width;
+    uint64_t h = source_config.fit_height;
+
+    if (w * native_height >= h * native_width) {
+        h = (w * native_height + native_width - 1) / native_width;
+    }
+    else {
+        w = (h * native_width + native_height - 1) / native_height;
+    }
+
+    pix->width = step_up(w, sw->min_width, sw->max_width, sw->step_width);
+    pix->height = step_up(h, sw->min_height, sw->max_height, sw->step_height);
+}
+
+/* the smallest frame size still covering the fit_width x fit_height grid, one
+   sample per cell, the largest one when none is big enough */
+static void fit_frame_size(uint32_t pixelformat, struct v4l2_pix_format *pix){
+
+    struct v4l2_frmsizeenum size;
+    uint64_t area;
+    uint64_t best = 0;
+    int covers;
+    int best_covers = 0;
+
+    CLEAR(size);
+    size.pixel_format = pixelformat;
+
+    while (0 == xioctl(fd, VIDIOC_ENUM_FRAMESIZES, &size)) {
+        if (V4L2_FRMSIZE_TYPE_DISCRETE != size.type) {
+            fit_stepwise_size(&size.stepwise, pix);
+            return;
+        }
+
+        area = (uint64_t)size.discrete.width * size.discrete.height;
+        covers = size.discrete.width >= source_config.fit_width &&
+                 size.discrete.height >= source_config.fit_height;
+
+        if ((covers && (!best_covers || area < best)) ||
+            (!covers && !best_covers && area > best)) {
+            best = area;
+            best_covers = covers;
+            pix->width = size.discrete.width;
+            pix->height = size.discrete.height;
+        }
+        size.index++;
+    }
+}
+
+static uint64_t interval_ns(const struct v4l2_fract *f){
+    return f->denominator ?
+           (uint64_t)f->numerator * 1000000000u / f->denominator : 0;
+}
+
+/* the shortest frame interval not under min_interval_ns, or the longest one
+   there is when they all are, 0/0 when the driver doesn't list any */
+static void fit_frame_interval(const struct v4l2_pix_format *pix,
+                               struct v4l2_fract *interval){
+
+    struct v4l2_frmivalenum ival;
+    uint64_t want = source_config.min_interval_ns;
+    uint64_t ns;
+    uint64_t best = 0;
+    int slow_enough;
+    int best_slow_enough = 0;
+
+    interval->numerator = 0;
+    interval->denominator = 0;
+
+    CLEAR(ival);
+    ival.pixel_format = pix->pixelformat;
+    ival.width = pix->width;
+    ival.height = pix->height;
+
+    while (0 == xioctl(fd, VIDIOC_ENUM_FRAMEINTERVALS, &ival)) {
+        if (V4L2_FRMIVAL_TYPE_DISCRETE != ival.type) {
+            /* in us, the driver rounds it to what it can do */
+            ns = interval_ns(&ival.stepwise.min);
+            if (want > ns) {
+                ns = want;
+            }
+            if (ns > interval_ns(&ival.stepwise.max)) {
+                *interval = ival.stepwise.max;
+                return;
+            }
+            interval->numerator = (ns + 999) / 1000;
+            interval->denominator = 1000000;
+            return;
+        }
+
+        ns = interval_ns(&ival.discrete);
+        slow_enough = ns >= want;
+
+        if ((slow_enough && (!best_slow_enough || ns < best)) ||
+            (!slow_enough && !best_slow_enough && ns > best)) {
+            best = ns;
+            best_slow_enough = slow_enough;
+            *interval = ival.discrete;
+        }
+        ival.index++;
+    }
+}
+
+static void set_format(struct v4l2_format *fmt, int i){
+
+    unsigned int min;
+
+    fmt->fmt.pix.pixelformat = formats[i].pixelformat;
+    fmt->fmt.pix.field = V4L2_FIELD_ANY;
+    fmt->fmt.pix.bytesperline = 0;
+    fmt->fmt.pix.sizeimage = 0;
+
+    if (-1 == xioctl(fd, VIDIOC_S_FMT, fmt)){
+        errno_exit("VIDIOC_S_FMT");
+    }
+
+    if (fmt->fmt.pix.pixelformat != formats[i].pixelformat) {
+        fprintf(stderr, "%s refused to capture %s\n",
+             source_config.device, formats[i].name);
+        exit(EXIT_FAILURE);
+    }
+
+    /* Buggy driver paranoia, compressed formats have no lines to check. */
+    if (formats[i].depth) {
+        min = fmt->fmt.pix.width * formats[i].depth;
+        if (fmt->fmt.pix.bytesperline < min){
+            fmt->fmt.pix.bytesperline = min;
+        }
+
+        min = fmt->fmt.pix.bytesperline * fmt->fmt.pix.height;
+        if (fmt->fmt.pix.sizeimage < min){
+            fmt->fmt.pix.sizeimage = min;
+        }
+    }
+
+    capture_format = fmt->fmt.pix;
+}
+
+/* drivers without V4L2_CAP_TIMEPERFRAME run at their own rate */
+static void set_interval(struct v4l2_fract *interval){
+
+    struct v4l2_streamparm parm;
+
+    if (!interval->denominator) {
+        return;
+    }
+
+    CLEAR(parm);
+    parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    if (-1 == xioctl(fd, VIDIOC_G_PARM, &parm) ||
+        !(parm.parm.capture.capability & V4L2_CAP_TIMEPERFRAME)) {
+        return;
+    }
+
+    parm.parm.capture.timeperframe = *interval;
+
+    if (-1 == xioctl(fd, VIDIOC_S_PARM, &parm)){
+        errno_exit("VIDIOC_S_PARM");
+    }
+}
+
+static int format_index(uint32_t pixelformat){
+
+    for (int i = 0; i < N_FORMATS; i++) {
+        if (formats[i].pixelformat == pixelformat) {
+            return i;
+        }
+    }
+
+    return 0;
+}
+
+static void init_recording(void){
+
+    char *index_name;
+
+    if (!source_config.record) {
+        return;
+    }
+
+    index_name = malloc(strlen(source_config.record) +
+                        sizeof(RECORDING_INDEX_SUFFIX));
+    if (!index_name) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    strcpy(index_name, source_config.record);
+    strcat(index_name, RECORDING_INDEX_SUFFIX);
+
+    record_data = fopen(source_config.record, "wb");
+    record_index = fopen(index_name, "w");
+
+    if (!record_data || !record_index) {
+        fprintf(stderr, "Cannot create '%s': %d, %s\n",
+             record_data ? index_name : source_config.record,
+             errno, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    free(index_name);
+
+    fprintf(record_index, "%.4s %u %u %u\n",
+        (char*)&capture_format.pixelformat,
+        capture_format.width,
+        capture_format.height,
+        V4L2_PIX_FMT_MJPEG == capture_format.pixelformat ?
+            0 : capture_format.bytesperline
+    );
+}
+
+static void record_frame(struct frame *frame){
+
+    /* timestamps in the index count from the first frame */
+    if (!record_frames++) {
+        record_start = frame->timestamp;
+    }
+
+    fwrite(frame->data, 1, frame->size, record_data);
+    fprintf(record_index, "%zu %zu %llu\n",
+        record_offset,
+        frame->size,
+        (unsigned long long)(frame->timestamp - record_start)
+    );
+    record_offset += frame->size;
+}
+
+static void init_device(void){
+
+    struct v4l2_capability cap;
+    struct v4l2_cropcap cropcap;
+    struct v4l2_crop crop;
+    struct v4l2_format fmt;
+    int i;
+
+    if (-1 == xioctl(fd, VIDIOC_QUERYCAP, &cap)) {
+        if (EINVAL == errno) {
+            fprintf(stderr, "%s is no V4L2 device\n",
+                 source_config.device);
+            exit(EXIT_FAILURE);
+        } else {
+            errno_exit("VIDIOC_QUERYCAP");
+        }
+    }
+
+    if (!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE)) {
+        fprintf(stderr, "%s is no video capture device\n",
+             source_config.device);
+        exit(EXIT_FAILURE);
+    }
+
+    if (!(cap.capabilities & V4L2_CAP_STREAMING)) {
+        fprintf(stderr, "%s does not support streaming i/o\n",
+             source_config.device);
+        exit(EXIT_FAILURE);
+    }
+
+    /* Select video input, video standard and tune here. */
+
+    CLEAR(cropcap);
+
+    cropcap.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    if (0 == xioctl(fd, VIDIOC_CROPCAP, &cropcap)) {
+        crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        crop.c = cropcap.defrect; /* reset to default */
+
+        if (-1 == xioctl(fd, VIDIOC_S_CROP, &crop)) {
+            switch (errno) {
+            case EINVAL:
+                /* Cropping not supported. */
+                break;
+            default:
+                /* Errors ignored. */
+                break;
+            }
+        }
+    } else {
+        /* Errors ignored. */
+    }
+
+    CLEAR(fmt);
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (-1 == xioctl(fd, VIDIOC_G_FMT, &fmt)){
+        errno_exit("VIDIOC_G_FMT");
+    }
+
+    i = pick_format();
+
+    if (source_config.fit) {
+        native_width = fmt.fmt.pix.width;
+        native_height = fmt.fmt.pix.height;
+        fit_frame_size(formats[i].pixelformat, &fmt.fmt.pix);
+    }
+    else {
+        pick_frame_size(formats[i].pixelformat, &fmt.fmt.pix);
+    }
+
+    fmt.fmt.pix.pixelformat = formats[i].pixelformat;
+    fitted = fmt.fmt.pix;
+    set_format(&fmt, i);
+
+    if (source_config.fit) {
+        fit_frame_interval(&fitted, &fitted_interval);
+        set_interval(&fitted_interval);
+    }
+
+    init_mmap();
+    init_recording();
+}
+
+static void close_device(void){
+
+    if (-1 == close(fd))
+        errno_exit("close");
+
+    fd = -1;
+
+    if (record_data) {
+        fclose(record_data);
+        fclose(record_index);
+    }
+}
+
+static void open_device(void){
+
+    struct stat st;
+
+    if (-1 == stat(source_config.device, &st)) {
+        fprintf(stderr, "Cannot identify '%s': %d, %s\n",
+             source_config.device, errno, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if (!S_ISCHR(st.st_mode)) {
+        fprintf(stderr, "%s is no devicen", source_config.device);
+        exit(EXIT_FAILURE);
+    }
+
+    fd = open(source_config.device, O_RDWR /* required */ | O_NONBLOCK, 0);
+
+    if (-1 == fd) {
+        fprintf(stderr, "Cannot open '%s': %d, %s\n",
+             source_config.device, errno, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+static uint64_t now_ns(void){
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static int v4l2_fd(void){
+    return fd;
+}
+
+static int v4l2_wait(int timeout_ms){
+
+    fd_set fds;
+    struct timeval tv;
+    int r;
+
+    for (;;) {
+        FD_ZERO(&fds);
+        FD_SET(fd, &fds);
+
+        tv.tv_sec = timeout_ms / 1000;
+        tv.tv_usec = (timeout_ms % 1000) * 1000;
+
+        r = select(fd + 1, &fds, NULL, NULL, &tv);
+
+        if (-1 == r) {
+            if (EINTR == errno)
+                continue;
+            errno_exit("select");
+        }
+
+        return r;
+    }
+}
+
+static int v4l2_get(struct frame *frame){
+
+    struct v4l2_buffer buf;
+
+    CLEAR(buf);
+
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_MMAP;
+    if (-1 == xioctl(fd, VIDIOC_DQBUF, &buf)) {
+        switch (errno) {
+        case EAGAIN:
+            return 0;
+        case EIO:
+            /* Could ignore EIO, see spec. */
+            /* fall through */
+        default:
+            errno_exit("VIDIOC_DQBUF");
+        }
+    }
+
+    assert(buf.index < n_buffers);
+
+    dequeued[buf.index] = buf;
+
+    frame->data = buffers[buf.index].start;
+    frame->size = buf.bytesused;
+    frame->index = buf.index;
+
+    /* drivers stamp with CLOCK_MONOTONIC nowadays, the rare ones that don't
+       get the time of the dequeue */
+    if (V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC ==
+        (buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK)) {
+        frame->timestamp = (uint64_t)buf.timestamp.tv_sec * 1000000000u +
+                           buf.timestamp.tv_usec * 1000u;
+    }
+    else {
+        frame->timestamp = now_ns();
+    }
+
+    if (record_data) {
+        record_frame(frame);
+    }
+
+    return 1;
+}
+
+static void v4l2_put(struct frame *frame){
+    if (-1 == xioctl(fd, VIDIOC_QBUF, &dequeued[frame->index])){
+        errno_exit("VIDIOC_QBUF");
+    }
+}
+
+static void v4l2_format(struct frame_format *fmt){
+    fmt->pixelformat = capture_format.pixelformat;
+    fmt->width = capture_format.width;
+    fmt->height = capture_format.height;
+    fmt->stride = capture_format.bytesperline;
+}
+
+static unsigned int v4l2_n_buffers(void){
+    return n_buffers;
+}
+
+/* the buffers of the old size have to go before the format can change, the
+   stream is restarted even when only the rate did, since most drivers refuse
+   VIDIOC_S_PARM while streaming */
+static int v4l2_refit(void){
+
+    struct v4l2_format fmt;
+    struct v4l2_requestbuffers req;
+    struct v4l2_fract interval;
+    int i = format_index(capture_format.pixelformat);
+
+    /* a recording has the one frame size in its index */
+    if (!source_config.fit || record_data) {
+        return 0;
+    }
+
+    CLEAR(fmt);
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    fmt.fmt.pix = capture_format;
+    fit_frame_size(capture_format.pixelformat, &fmt.fmt.pix);
+    fit_frame_interval(&fmt.fmt.pix, &interval);
+
+    if (fmt.fmt.pix.width == fitted.width &&
+        fmt.fmt.pix.height == fitted.height &&
+        interval_ns(&interval) == interval_ns(&fitted_interval)) {
+        return 0;
+    }
+
+    fitted = fmt.fmt.pix;
+    fitted_interval = interval;
+
+    stop_capturing();
+    uninit_device();
+
+    CLEAR(req);
+    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = V4L2_MEMORY_MMAP;
+    if (-1 == xioctl(fd, VIDIOC_REQBUFS, &req)) {
+        errno_exit("VIDIOC_REQBUFS");
+    }
+
+    set_format(&fmt, i);
+    set_interval(&fitted_interval);
+
+    init_mmap();
+    start_capturing();
+
+    return 1;
+}
+
+const struct frame_source v4l2_source = {
+    open_device,
+    init_device,
+    start_capturing,
+    stop_capturing,
+    uninit_device,
+    close_device,
+    v4l2_fd,
+    v4l2_wait,
+    v4l2_get,
+    v4l2_put,
+    v4l2_format,
+    v4l2_n_buffers,
+    v4l2_refit
+};